@@ -19,7 +19,7 @@
 #include <linux/slab.h>
 #include <linux/sched.h>
 #include <linux/init.h>
-#include <linux/hashtable.h>
+#include <linux/radix-tree.h>
 #include <linux/uaccess.h>
 #include <linux/sizes.h>
 
@@ -61,6 +61,8 @@ static void __kdbus_bus_free(struct kref *kref)
 	kdbus_bus_disconnect(bus);
 	pr_debug("clean up bus %s/%s\n", bus->ns->devpath, bus->name);
 
+	if (bus->broadcast_wq)
+		destroy_workqueue(bus->broadcast_wq);
 	kfree(bus->name);
 	kfree(bus);
 }
@@ -76,15 +78,16 @@ void kdbus_bus_unref(struct kdbus_bus *bus)
 	kref_put(&bus->kref, __kdbus_bus_free);
 }
 
+/* Connections are linked into the bus with bus->lock held, and looked
+ * up with bus->lock or rcu_read_lock() held; the returned connection is
+ * not pinned. */
 struct kdbus_conn *kdbus_bus_find_conn_by_id(struct kdbus_bus *bus, u64 id)
 {
-	struct kdbus_conn *conn;
+	/* ids beyond the index of a 32 bit system are never handed out */
+	if (id != (unsigned long)id)
+		return NULL;
 
-	hash_for_each_possible(bus->conn_hash, conn, hentry, id)
-		if (conn->id == id)
-			return conn;
-
-	return NULL;
+	return radix_tree_lookup(&bus->conn_tree, id);
 }
 
 /**
@@ -174,7 +177,7 @@ int kdbus_bus_new(struct kdbus_ns *ns, struct kdbus_cmd_bus_kmake *bus_kmake,
 	b->bloom_size = bus_kmake->make.bloom_size;
 	b->conn_id_next = 1; /* connection 0 == kernel */
 	mutex_init(&b->lock);
-	hash_init(b->conn_hash);
+	INIT_RADIX_TREE(&b->conn_tree, GFP_KERNEL);
 	INIT_LIST_HEAD(&b->eps_list);
 	INIT_LIST_HEAD(&b->monitors_list);
 
@@ -190,6 +193,16 @@ int kdbus_bus_new(struct kdbus_ns *ns, struct kdbus_cmd_bus_kmake *bus_kmake,
 		goto ret;
 	}
 
+	/* deliver broadcasts to large numbers of receivers on all CPUs */
+	if (b->bus_flags & KDBUS_MAKE_BROADCAST_PARALLEL) {
+		b->broadcast_wq = alloc_workqueue("kdbus-%s", WQ_UNBOUND, 0,
+						  b->name);
+		if (!b->broadcast_wq) {
+			ret = -ENOMEM;
+			goto ret;
+		}
+	}
+
 	ret = kdbus_ep_new(b, "bus", mode, uid, gid,
 			   b->bus_flags & KDBUS_MAKE_POLICY_OPEN);
 	if (ret < 0)
@@ -12,8 +12,8 @@
 #ifndef __KDBUS_BUS_H
 #define __KDBUS_BUS_H
 
-#include <linux/idr.h>
-#include <linux/hashtable.h>
+#include <linux/radix-tree.h>
+#include <linux/workqueue.h>
 
 #include "internal.h"
 
@@ -37,14 +37,15 @@ struct kdbus_bus {
 	u64 ep_id_next;			/* next endpoint id sequence number */
 	u64 conn_id_next;		/* next connection id sequence number */
 	u64 msg_id_next;		/* next message id sequence number */
-	struct idr conn_idr;		/* map of connection ids */
-	DECLARE_HASHTABLE(conn_hash, 6);
+	struct radix_tree_root conn_tree;	/* connections by id, RCU */
+	unsigned int conn_count;	/* number of connections */
 	struct list_head eps_list;	/* endpoints on this bus */
 	u64 bus_flags;			/* simple pass-thru flags from userspace to userspace */
 	size_t bloom_size;		/* bloom filter size */
 	struct kdbus_name_registry *name_registry;
 	struct list_head bus_entry;	/* namespace's list of buses */
 	struct list_head monitors_list;	/* connections that monitor */
+	struct workqueue_struct *broadcast_wq;	/* KDBUS_MAKE_BROADCAST_PARALLEL */
 };
 
 struct kdbus_cmd_bus_kmake {
@@ -24,6 +24,11 @@
 #include <linux/poll.h>
 #include <linux/file.h>
 #include <linux/hashtable.h>
+#include <linux/llist.h>
+#include <linux/radix-tree.h>
+#include <linux/mmu_context.h>
+#include <linux/completion.h>
+#include <linux/cred.h>
 #include <linux/audit.h>
 #include <linux/security.h>
 #include <linux/mm.h>
@@ -48,6 +53,9 @@ void kdbus_conn_unref(struct kdbus_conn *conn);
 
 struct kdbus_conn_queue {
 	struct list_head entry;
+	struct list_head prio_entry;
+	struct llist_node incoming;
+	unsigned int priority;
 
 	/* offset to the message placed in the receiver's buffer */
 	size_t off;
@@ -62,11 +70,53 @@ struct kdbus_conn_queue {
 	struct file **fds_fp;
 	unsigned int fds_count;
 
-	/* timeout in the queue */
-	u64 deadline_ns;
+	/* the tracked reply or timeout of the message */
+	struct kdbus_conn_reply *reply;
+
+	/* the message replies to a message of the receiver */
+	u64 cookie_reply;
+	u64 src_id;
+
+	/* the kernel's KDBUS_MSG_REPLY_TIMEOUT notification */
+	bool reply_timeout;
+};
+
+/* A sender waiting for space in the queue or pool of a receiver. The
+ * sender is looked up by its id when the receiver frees space; a waiter
+ * does not keep a sender which disconnected around. */
+struct kdbus_conn_space_waiter {
+	struct list_head entry;		/* receiver's space_waiters */
 	u64 src_id;
+};
+
+/* A KDBUS_CMD_MSG_CALL waiting for its reply. The reply, or the kernel's
+ * notification about the call, is taken out of the queue when it is
+ * linked; a concurrent RECV does not see it. A call which timed out or
+ * was interrupted stays around until its reply arrives, which is then
+ * dropped. */
+struct kdbus_conn_call {
+	struct list_head entry;			/* conn->calls */
 	u64 cookie;
+	u64 dst_id;				/* the connection called */
+	struct kdbus_conn_queue *queue;		/* the reply, once linked */
+	bool cancelled;
+};
+
+/* A message which expects a reply, or has a timeout, is tracked by its
+ * receiver from the moment it is queued, until the reply is sent, the
+ * timeout passes or the receiver disconnects. After the message is
+ * received, only a message which expects a reply is still tracked. */
+struct kdbus_conn_reply {
+	struct hlist_node hentry;	/* reply_hash, by cookie */
+	struct rb_node deadline_node;	/* deadlines, by deadline_ns */
+	struct list_head entry;		/* to notify, after conn->lock */
+	struct kdbus_conn_queue *queue;	/* the message while it is queued */
+	u64 src_id;			/* the sender waiting for the reply */
+	u64 cookie;
+	u64 deadline_ns;
 	bool expect_reply;
+	bool accounted;			/* counted in the sender's reply_count */
+	bool sync;			/* the sender waits in MSG_CALL */
 };
 
 static void kdbus_conn_fds_unref(struct kdbus_conn_queue *queue)
@@ -173,12 +223,17 @@ exit_unref:
 	return ret;
 }
 
-static int kdbus_conn_payload_add(struct kdbus_conn *conn,
-				  struct kdbus_conn_queue *queue,
+/* Fill in the PAYLOAD items of the message in the receiver's pool, and
+ * collect the user buffers to copy the data of the kdbus_vecs from. */
+static int kdbus_conn_payload_add(struct kdbus_conn_queue *queue,
 				  const struct kdbus_kmsg *kmsg,
-				  size_t off, size_t items, size_t vec_data)
+				  size_t off, size_t items, size_t vec_data,
+				  struct kdbus_item *payload,
+				  struct iovec *iov, size_t *iov_count)
 {
 	const struct kdbus_item *item;
+	struct kdbus_item *it = payload;
+	size_t count = 0;
 	int ret;
 
 	if (kmsg->memfds_count > 0) {
@@ -198,14 +253,10 @@ static int kdbus_conn_payload_add(struct kdbus_conn *conn,
 	KDBUS_PART_FOREACH(item, &kmsg->msg, items) {
 		switch (item->type) {
 		case KDBUS_MSG_PAYLOAD_VEC: {
-			const size_t size = KDBUS_PART_HEADER_SIZE +
-					    sizeof(struct kdbus_vec);
-			char tmp[size];
-			struct kdbus_item *it = (struct kdbus_item *)tmp;
-
 			/* add item */
 			it->type = KDBUS_MSG_PAYLOAD_OFF;
-			it->size = size;
+			it->size = KDBUS_PART_HEADER_SIZE +
+				   sizeof(struct kdbus_vec);
 
 			/* a NULL address specifies a \0-bytes record */
 			if (KDBUS_PTR(item->vec.address))
@@ -213,10 +264,8 @@ static int kdbus_conn_payload_add(struct kdbus_conn *conn,
 			else
 				it->vec.offset = ~0ULL;
 			it->vec.size = item->vec.size;
-			ret = kdbus_pool_write(conn->pool, off + items, it, size);
-			if (ret < 0)
-				return ret;
 			items += KDBUS_ALIGN8(it->size);
+			it = KDBUS_PART_NEXT(it);
 
 			/* \0-bytes record */
 			if (!KDBUS_PTR(item->vec.address)) {
@@ -229,38 +278,32 @@ static int kdbus_conn_payload_add(struct kdbus_conn *conn,
 				 * record in the output buffer; write as many
 				 * null-bytes to the buffer which the \0-bytes
 				 * record would have shifted the alignment */
-				kdbus_pool_write_user(conn->pool, off + vec_data,
-						      "\0\0\0\0\0\0\0", pad);
+				iov[count].iov_base = NULL;
+				iov[count].iov_len = pad;
+				count++;
 				vec_data += pad;
 				break;
 			}
 
 			/* copy kdbus_vec data from sender to receiver */
-			ret = kdbus_pool_write_user(conn->pool, off + vec_data,
-				KDBUS_PTR(item->vec.address), item->vec.size);
-			if (ret < 0)
-				return ret;
-
+			iov[count].iov_base = KDBUS_PTR(item->vec.address);
+			iov[count].iov_len = item->vec.size;
+			count++;
 			vec_data += item->vec.size;
 			break;
 		}
 
 		case KDBUS_MSG_PAYLOAD_MEMFD: {
-			const size_t size = KDBUS_PART_HEADER_SIZE +
-					    sizeof(struct kdbus_memfd);
-			char tmp[size];
-			struct kdbus_item *it = (struct kdbus_item *)tmp;
 			struct file *fp;
 			size_t memfd;
 
 			/* add item */
 			it->type = KDBUS_MSG_PAYLOAD_MEMFD;
-			it->size = size;
+			it->size = KDBUS_PART_HEADER_SIZE +
+				   sizeof(struct kdbus_memfd);
 			it->memfd.size = item->memfd.size;
 			it->memfd.fd = -1;
-			ret = kdbus_pool_write(conn->pool, off + items, it, size);
-			if (ret < 0)
-				return ret;
+			it->memfd.__pad = 0;
 
 			/* grab reference of incoming file */
 			ret = kdbus_conn_memfd_ref(item, &fp);
@@ -275,6 +318,7 @@ static int kdbus_conn_payload_add(struct kdbus_conn *conn,
 			queue->memfds_count++;
 
 			items += KDBUS_ALIGN8((it)->size);
+			it = KDBUS_PART_NEXT(it);
 			break;
 		}
 
@@ -283,49 +327,448 @@ static int kdbus_conn_payload_add(struct kdbus_conn *conn,
 		}
 	}
 
+	*iov_count = count;
+	return 0;
+}
+
+/* Add a tracked message with a timeout to the tree of pending deadlines;
+ * if it is the next one to expire, re-arm the timer of the connection. */
+static void kdbus_conn_deadline_add(struct kdbus_conn *conn,
+				    struct kdbus_conn_reply *reply)
+{
+	struct rb_node **n = &conn->deadlines.rb_node;
+	struct rb_node *parent = NULL;
+	bool leftmost = true;
+
+	while (*n) {
+		struct kdbus_conn_reply *r;
+
+		parent = *n;
+		r = rb_entry(parent, struct kdbus_conn_reply, deadline_node);
+		if (reply->deadline_ns < r->deadline_ns) {
+			n = &parent->rb_left;
+		} else {
+			n = &parent->rb_right;
+			leftmost = false;
+		}
+	}
+
+	rb_link_node(&reply->deadline_node, parent, n);
+	rb_insert_color(&reply->deadline_node, &conn->deadlines);
+
+	if (leftmost)
+		hrtimer_start(&conn->timer, ns_to_ktime(reply->deadline_ns),
+			      HRTIMER_MODE_ABS);
+}
+
+/* Account a call waiting for its reply to the caller. The caller is
+ * looked up by its id; a caller which is gone does not come back, its
+ * calls are no longer accounted. */
+static void kdbus_conn_reply_account(struct kdbus_conn *conn, u64 src_id,
+				     int n)
+{
+	struct kdbus_conn *c;
+
+	rcu_read_lock();
+	c = kdbus_bus_find_conn_by_id(conn->ep->bus, src_id);
+	if (c)
+		atomic_add(n, &c->reply_count);
+	rcu_read_unlock();
+}
+
+/* start tracking a message; called with conn->lock held */
+static void kdbus_conn_reply_link(struct kdbus_conn *conn,
+				  struct kdbus_conn_reply *reply)
+{
+	if (reply->expect_reply) {
+		hash_add(conn->reply_hash, &reply->hentry, reply->cookie);
+
+		/* the calls linked after the cleanup are dropped with the
+		 * last reference, when the bus might be gone already */
+		if (conn->type == KDBUS_CONN_EP_CONNECTED) {
+			kdbus_conn_reply_account(conn, reply->src_id, 1);
+			reply->accounted = true;
+		}
+	}
+
+	if (reply->deadline_ns)
+		kdbus_conn_deadline_add(conn, reply);
+}
+
+/* stop tracking a message; called with conn->lock held */
+static void kdbus_conn_reply_unlink(struct kdbus_conn *conn,
+				    struct kdbus_conn_reply *reply)
+{
+	if (!hlist_unhashed(&reply->hentry)) {
+		hash_del(&reply->hentry);
+		if (reply->accounted) {
+			kdbus_conn_reply_account(conn, reply->src_id, -1);
+			reply->accounted = false;
+		}
+	}
+
+	if (!RB_EMPTY_NODE(&reply->deadline_node)) {
+		rb_erase(&reply->deadline_node, &conn->deadlines);
+		RB_CLEAR_NODE(&reply->deadline_node);
+	}
+
+	if (reply->queue) {
+		reply->queue->reply = NULL;
+		reply->queue = NULL;
+	}
+}
+
+/* look up the tracked message the given message replies to; the
+ * destination of the reply must be the sender of the tracked message;
+ * called with conn->lock held */
+static struct kdbus_conn_reply *
+kdbus_conn_reply_find(struct kdbus_conn *conn, u64 dst_id, u64 cookie)
+{
+	struct kdbus_conn_reply *reply;
+
+	hash_for_each_possible(conn->reply_hash, reply, hentry, cookie)
+		if (reply->cookie == cookie && reply->src_id == dst_id)
+			return reply;
+
+	return NULL;
+}
+
+/* Check whether a message replies to a tracked message, and whether the
+ * sender of the tracked message waits for the reply in
+ * KDBUS_CMD_MSG_CALL. The message stays tracked until the reply is
+ * queued. */
+static bool kdbus_conn_reply_check(struct kdbus_conn *conn, u64 dst_id,
+				   u64 cookie, bool *sync)
+{
+	struct kdbus_conn_reply *reply;
+
+	mutex_lock(&conn->lock);
+	reply = kdbus_conn_reply_find(conn, dst_id, cookie);
+	if (reply)
+		*sync = reply->sync;
+	mutex_unlock(&conn->lock);
+
+	return reply != NULL;
+}
+
+/* stop tracking a message after its reply is queued */
+static void kdbus_conn_reply_complete(struct kdbus_conn *conn, u64 dst_id,
+				      u64 cookie)
+{
+	struct kdbus_conn_reply *reply;
+
+	mutex_lock(&conn->lock);
+	reply = kdbus_conn_reply_find(conn, dst_id, cookie);
+	if (reply) {
+		kdbus_conn_reply_unlink(conn, reply);
+		kfree(reply);
+	}
+	mutex_unlock(&conn->lock);
+}
+
+/* link a message into the receiver's queue */
+static void kdbus_conn_queue_add(struct kdbus_conn *conn,
+				 struct kdbus_conn_queue *queue)
+{
+	list_add_tail(&queue->entry, &conn->msg_list);
+	list_add_tail(&queue->prio_entry,
+		      &conn->msg_prio_list[queue->priority]);
+	__set_bit(queue->priority, &conn->msg_prio_mask);
+	if (queue->reply)
+		kdbus_conn_reply_link(conn, queue->reply);
+}
+
+/* Unlink a message from the receiver's queue. A message which expects
+ * a reply stays tracked. */
+static void kdbus_conn_queue_remove(struct kdbus_conn *conn,
+				    struct kdbus_conn_queue *queue)
+{
+	struct kdbus_conn_reply *reply = queue->reply;
+
+	if (reply) {
+		reply->queue = NULL;
+		queue->reply = NULL;
+		if (!reply->expect_reply) {
+			kdbus_conn_reply_unlink(conn, reply);
+			kfree(reply);
+		}
+	}
+
+	list_del(&queue->entry);
+	list_del(&queue->prio_entry);
+	if (list_empty(&conn->msg_prio_list[queue->priority]))
+		__clear_bit(queue->priority, &conn->msg_prio_mask);
+	atomic_dec(&conn->msg_count);
+}
+
+/* Take the reply to a pending call, from the called connection or the
+ * kernel, out of the queue; called with conn->lock held */
+static bool kdbus_conn_call_take(struct kdbus_conn *conn,
+				 struct kdbus_conn_queue *queue)
+{
+	struct kdbus_conn_call *call;
+
+	if (!queue->cookie_reply)
+		return false;
+
+	list_for_each_entry(call, &conn->calls, entry) {
+		if (call->cookie != queue->cookie_reply || call->queue)
+			continue;
+
+		if (queue->src_id != call->dst_id &&
+		    queue->src_id != KDBUS_SRC_ID_KERNEL)
+			continue;
+
+		/* nobody waits for it anymore */
+		if (call->cancelled) {
+			list_del(&call->entry);
+			kfree(call);
+			atomic_dec(&conn->msg_count);
+			kdbus_pool_free(conn->pool, queue->off);
+			kdbus_conn_queue_cleanup(queue);
+			return true;
+		}
+
+		call->queue = queue;
+		wake_up_interruptible(&conn->wait);
+		return true;
+	}
+
+	return false;
+}
+
+/* Senders do not take conn->lock, they push their messages to the
+ * lock-free list of incoming messages. The receiver links them into
+ * its queue before it looks at it. Called with conn->lock held. */
+static void kdbus_conn_queue_splice(struct kdbus_conn *conn)
+{
+	struct llist_node *node, *next, *first = NULL;
+
+	/* the list is in LIFO order, restore the order of sending */
+	node = llist_del_all(&conn->msg_incoming);
+	while (node) {
+		next = node->next;
+		node->next = first;
+		first = node;
+		node = next;
+	}
+
+	for (node = first; node; node = next) {
+		struct kdbus_conn_queue *queue;
+
+		next = node->next;
+		queue = llist_entry(node, struct kdbus_conn_queue, incoming);
+		if (!list_empty(&conn->calls) &&
+		    kdbus_conn_call_take(conn, queue))
+			continue;
+
+		kdbus_conn_queue_add(conn, queue);
+	}
+}
+
+/* Drop the incoming messages which were published to a receiver after
+ * its cleanup took the incoming messages; they are not linked into the
+ * queue, nothing tracks them. */
+static void kdbus_conn_incoming_flush(struct kdbus_conn *conn)
+{
+	struct llist_node *node, *next;
+
+	node = llist_del_all(&conn->msg_incoming);
+	for (; node; node = next) {
+		struct kdbus_conn_queue *queue;
+
+		next = node->next;
+		queue = llist_entry(node, struct kdbus_conn_queue, incoming);
+		atomic_dec(&conn->msg_count);
+		kdbus_pool_free(conn->pool, queue->off);
+		kdbus_conn_queue_cleanup(queue);
+	}
+}
+
+/* drop all queued messages, and the calls given up on; called with
+ * conn->lock held */
+static void kdbus_conn_queue_flush(struct kdbus_conn *conn)
+{
+	struct kdbus_conn_queue *queue, *tmp;
+	struct kdbus_conn_call *call, *call_tmp;
+
+	kdbus_conn_queue_splice(conn);
+	list_for_each_entry_safe(queue, tmp, &conn->msg_list, entry) {
+		kdbus_conn_queue_remove(conn, queue);
+		kdbus_pool_free(conn->pool, queue->off);
+		kdbus_conn_queue_cleanup(queue);
+	}
+
+	list_for_each_entry_safe(call, call_tmp, &conn->calls, entry) {
+		if (call->queue) {
+			atomic_dec(&conn->msg_count);
+			kdbus_pool_free(conn->pool, call->queue->off);
+			kdbus_conn_queue_cleanup(call->queue);
+		}
+
+		list_del(&call->entry);
+		kfree(call);
+	}
+}
+
+/* The next message to receive: the oldest message of the highest
+ * priority level. The receive ring of the pool publishes the messages
+ * in the order they are queued; with a ring, the priority is ignored. */
+static struct kdbus_conn_queue *kdbus_conn_queue_first(struct kdbus_conn *conn)
+{
+	unsigned int priority;
+
+	if (kdbus_pool_flags(conn->pool) & KDBUS_POOL_RING)
+		return list_first_entry(&conn->msg_list,
+					struct kdbus_conn_queue, entry);
+
+	priority = __fls(conn->msg_prio_mask);
+	return list_first_entry(&conn->msg_prio_list[priority],
+				struct kdbus_conn_queue, prio_entry);
+}
+
+/* Remove the messages from the queue which the receiver consumed from
+ * the receive ring of its pool, and free the messages it published in
+ * the release ring. Called with conn->lock held. */
+static void kdbus_conn_ring_drain(struct kdbus_conn *conn)
+{
+	unsigned int n;
+
+	if (!(kdbus_pool_flags(conn->pool) & KDBUS_POOL_RING))
+		return;
+
+	n = kdbus_pool_ring_pull(conn->pool);
+	while (n-- > 0 && !list_empty(&conn->msg_list)) {
+		struct kdbus_conn_queue *queue;
+
+		queue = list_first_entry(&conn->msg_list,
+					 struct kdbus_conn_queue, entry);
+		kdbus_conn_queue_remove(conn, queue);
+		kdbus_conn_queue_cleanup(queue);
+	}
+
+	kdbus_pool_ring_release(conn->pool);
+}
+
+/* The receiver freed space in its queue or its pool; wake up the
+ * senders which ran out of space sending to it. The sequence tells the
+ * senders which are just about to wait about it. */
+static void kdbus_conn_space_notify(struct kdbus_conn *conn)
+{
+	struct kdbus_conn_space_waiter *w, *tmp;
+	LIST_HEAD(list);
+
+	atomic_inc(&conn->space_seq);
+	smp_mb__after_atomic_inc();
+	if (list_empty(&conn->space_waiters))
+		return;
+
+	mutex_lock(&conn->lock);
+	list_splice_init(&conn->space_waiters, &list);
+	mutex_unlock(&conn->lock);
+
+	list_for_each_entry_safe(w, tmp, &list, entry) {
+		struct kdbus_conn *c;
+
+		rcu_read_lock();
+		c = kdbus_bus_find_conn_by_id(conn->ep->bus, w->src_id);
+		if (c) {
+			atomic_dec(&c->space_blocked);
+			wake_up_interruptible(&c->wait);
+		}
+		rcu_read_unlock();
+		kfree(w);
+	}
+}
+
+/* The receiver had no space for a message of the sender; the sender is
+ * not writable until the receiver frees space. The sequence read before
+ * the failed attempt catches the space freed in the meantime. A sender
+ * waits on every receiver which ran out of space, at most once on each
+ * of them. */
+static int kdbus_conn_space_wait(struct kdbus_conn *conn,
+				 struct kdbus_conn *conn_src, int seq)
+{
+	struct kdbus_conn_space_waiter *w;
+	int ret = 0;
+
+	mutex_lock(&conn->lock);
+	if (conn->type != KDBUS_CONN_EP_CONNECTED) {
+		ret = -ENOTCONN;
+		goto exit_unlock;
+	}
+
+	list_for_each_entry(w, &conn->space_waiters, entry)
+		if (w->src_id == conn_src->id)
+			goto exit_unlock;
+
+	w = kmalloc(sizeof(struct kdbus_conn_space_waiter), GFP_KERNEL);
+	if (!w) {
+		ret = -ENOMEM;
+		goto exit_unlock;
+	}
+
+	w->src_id = conn_src->id;
+	atomic_inc(&conn_src->space_blocked);
+	list_add_tail(&w->entry, &conn->space_waiters);
+	mutex_unlock(&conn->lock);
+
+	smp_mb();
+	if (atomic_read(&conn->space_seq) != seq)
+		kdbus_conn_space_notify(conn);
+
 	return 0;
+
+exit_unlock:
+	mutex_unlock(&conn->lock);
+	return ret;
+}
+
+/* drain the rings of the pool, if it has any */
+static void kdbus_conn_ring_sync(struct kdbus_conn *conn)
+{
+	if (!(kdbus_pool_flags(conn->pool) & KDBUS_POOL_RING))
+		return;
+
+	mutex_lock(&conn->lock);
+	kdbus_conn_ring_drain(conn);
+	mutex_unlock(&conn->lock);
+
+	kdbus_conn_space_notify(conn);
 }
 
 void kdbus_conn_queue_cleanup(struct kdbus_conn_queue *queue)
 {
 	kdbus_conn_memfds_unref(queue);
 	kdbus_conn_fds_unref(queue);
+	kfree(queue->reply);
 	kfree(queue);
 }
 
-/* enqueue a message into the receiver's pool */
-int kdbus_conn_queue_insert(struct kdbus_conn *conn, struct kdbus_kmsg *kmsg,
-			    u64 deadline_ns)
+/* Write a message into a pool, as it is received: the header, the
+ * PAYLOAD and FDS items, the metadata, and the kdbus_vec data. The
+ * files passed along are collected in the queue entry.
+ *
+ * Return: size of the message in the pool, < 0 on failure */
+static ssize_t kdbus_conn_msg_write(struct kdbus_pool *pool,
+				    struct kdbus_conn_queue *queue,
+				    struct kdbus_kmsg *kmsg, size_t *off_out)
 {
-	struct kdbus_conn_queue *queue;
+	struct kdbus_item *payload = NULL;
+	struct iovec *iov = NULL;
+	size_t iov_count = 0;
+	char fds_item[KDBUS_PART_HEADER_SIZE];
+	struct kvec kvec[7];
+	size_t kvec_count = 0;
 	u64 msg_size;
 	size_t size;
 	size_t payloads = 0;
+	size_t payloads_size = 0;
 	size_t fds = 0;
-	size_t meta = 0;
 	size_t vec_data;
 	size_t want, have;
 	size_t off;
-	int ret = 0;
-
-	if (!conn->type == KDBUS_CONN_EP_CONNECTED)
-		return -ENOTCONN;
-
-	if (kmsg->fds && !(conn->flags & KDBUS_HELLO_ACCEPT_FD))
-		return -ECOMM;
-
-	queue = kzalloc(sizeof(struct kdbus_conn_queue), GFP_KERNEL);
-	if (!queue)
-		return -ENOMEM;
-
-	INIT_LIST_HEAD(&queue->entry);
-
-	/* copy message properties we need for the queue management */
-	queue->deadline_ns = deadline_ns;
-	queue->src_id = kmsg->msg.src_id;
-	queue->cookie = kmsg->msg.cookie;
-	if (kmsg->msg.flags & KDBUS_MSG_FLAGS_EXPECT_REPLY)
-		queue->expect_reply = true;
+	ssize_t ret;
 
 	/* we accept items from kernel-created messages */
 	if (kmsg->msg.src_id == KDBUS_SRC_ID_KERNEL)
@@ -339,10 +782,11 @@ int kdbus_conn_queue_insert(struct kdbus_conn *conn, struct kdbus_kmsg *kmsg,
 	/* space for PAYLOAD items */
 	if ((kmsg->vecs_count + kmsg->memfds_count) > 0) {
 		payloads = msg_size;
-		msg_size += KDBUS_ITEM_SIZE(sizeof(struct kdbus_vec)) *
-			    kmsg->vecs_count;
-		msg_size += KDBUS_ITEM_SIZE(sizeof(struct kdbus_memfd)) *
-			    kmsg->memfds_count;
+		payloads_size = KDBUS_ITEM_SIZE(sizeof(struct kdbus_vec)) *
+				kmsg->vecs_count;
+		payloads_size += KDBUS_ITEM_SIZE(sizeof(struct kdbus_memfd)) *
+				 kmsg->memfds_count;
+		msg_size += payloads_size;
 	}
 
 	/* space for FDS item */
@@ -352,64 +796,76 @@ int kdbus_conn_queue_insert(struct kdbus_conn *conn, struct kdbus_kmsg *kmsg,
 	}
 
 	/* space for metadata/credential items */
-	if (kmsg->meta_size > 0) {
-		meta = msg_size;
+	if (kmsg->meta_size > 0)
 		msg_size += kmsg->meta_size;
-	}
 
 	/* data starts after the message */
 	vec_data = KDBUS_ALIGN8(msg_size);
 
-	/* allocate the needed space in the pool of the receiver */
-	mutex_lock(&conn->lock);
-	if (!capable(CAP_IPC_OWNER) &&
-	    conn->msg_count > KDBUS_CONN_MAX_MSGS) {
-		ret = -ENOBUFS;
-		goto exit_unlock;
-	}
-
 	/* do not give out more than half of the remaining space */
 	want = vec_data + kmsg->vecs_size;
-	have = kdbus_pool_remain(conn->pool);
-	if (want < have && want > have / 2) {
-		ret = -EXFULL;
-		goto exit_unlock;
-	}
+	have = kdbus_pool_remain(pool);
+	if (want < have && want > have / 2)
+		return -EXFULL;
 
-	ret = kdbus_pool_alloc(conn->pool, want, &off);
+	ret = kdbus_pool_alloc(pool, want, &off);
 	if (ret < 0)
-		goto exit_unlock;
-	mutex_unlock(&conn->lock);
+		return ret;
 
-	/* copy the message header */
-	ret = kdbus_pool_write(conn->pool, off, &kmsg->msg, size);
-	if (ret < 0)
-		goto exit;
+	/* the message header, with the updated size */
+	kvec[kvec_count].iov_base = &msg_size;
+	kvec[kvec_count].iov_len = sizeof(kmsg->msg.size);
+	kvec_count++;
 
-	/* update the size */
-	ret = kdbus_pool_write(conn->pool, off, &msg_size, sizeof(kmsg->msg.size));
-	if (ret < 0)
-		goto exit;
+	kvec[kvec_count].iov_base = (u8 *)&kmsg->msg + sizeof(kmsg->msg.size);
+	kvec[kvec_count].iov_len = size - sizeof(kmsg->msg.size);
+	kvec_count++;
 
 	/* add PAYLOAD items */
 	if (kmsg->vecs_count + kmsg->memfds_count > 0) {
-		ret = kdbus_conn_payload_add(conn, queue, kmsg,
-					     off, payloads, vec_data);
+		payload = kmalloc(payloads_size, GFP_KERNEL);
+		if (!payload) {
+			ret = -ENOMEM;
+			goto exit;
+		}
+
+		if (kmsg->vecs_count > 0) {
+			iov = kmalloc(kmsg->vecs_count * sizeof(struct iovec),
+				      GFP_KERNEL);
+			if (!iov) {
+				ret = -ENOMEM;
+				goto exit;
+			}
+		}
+
+		ret = kdbus_conn_payload_add(queue, kmsg, off, payloads,
+					     vec_data, payload,
+					     iov, &iov_count);
 		if (ret < 0)
 			goto exit;
+
+		kvec[kvec_count].iov_base = payload;
+		kvec[kvec_count].iov_len = payloads_size;
+		kvec_count++;
 	}
 
 	/* add a FDS item; the array content will be updated at RECV time */
 	if (kmsg->fds_count > 0) {
-		const size_t size = KDBUS_PART_HEADER_SIZE;
-		char tmp[size];
-		struct kdbus_item *it = (struct kdbus_item *)tmp;
+		struct kdbus_item *it = (struct kdbus_item *)fds_item;
 
 		it->type = KDBUS_MSG_FDS;
-		it->size = size + (kmsg->fds_count * sizeof(int));
-		ret = kdbus_pool_write(conn->pool, off + fds, it, size);
-		if (ret < 0)
-			goto exit;
+		it->size = KDBUS_PART_HEADER_SIZE +
+			   (kmsg->fds_count * sizeof(int));
+
+		kvec[kvec_count].iov_base = it;
+		kvec[kvec_count].iov_len = KDBUS_PART_HEADER_SIZE;
+		kvec_count++;
+
+		kvec[kvec_count].iov_base = NULL;
+		kvec[kvec_count].iov_len =
+			KDBUS_ITEM_SIZE(kmsg->fds_count * sizeof(int)) -
+			KDBUS_PART_HEADER_SIZE;
+		kvec_count++;
 
 		ret = kdbus_conn_fds_ref(queue, kmsg->fds, kmsg->fds_count);
 		if (ret < 0)
@@ -422,65 +878,222 @@ int kdbus_conn_queue_insert(struct kdbus_conn *conn, struct kdbus_kmsg *kmsg,
 
 	/* append message metadata/credential items */
 	if (kmsg->meta_size > 0) {
-		ret = kdbus_pool_write(conn->pool, off + meta,
-				       kmsg->meta, kmsg->meta_size);
-		if (ret < 0)
-			goto exit;
+		kvec[kvec_count].iov_base = kmsg->meta;
+		kvec[kvec_count].iov_len = kmsg->meta_size;
+		kvec_count++;
 	}
 
-	/* remember the offset to the message */
-	queue->off = off;
+	/* padding up to the data of the kdbus_vecs */
+	if (vec_data > msg_size) {
+		kvec[kvec_count].iov_base = NULL;
+		kvec[kvec_count].iov_len = vec_data - msg_size;
+		kvec_count++;
+	}
 
-	/* link the message into the receiver's queue */
-	mutex_lock(&conn->lock);
-	list_add_tail(&queue->entry, &conn->msg_list);
-	conn->msg_count++;
-	mutex_unlock(&conn->lock);
+	/* copy the message and the kdbus_vec data in a single pass */
+	ret = kdbus_pool_writev(pool, off, kvec, kvec_count, iov, iov_count);
+	if (ret < 0)
+		goto exit;
 
-	/* wake up poll() */
-	wake_up_interruptible(&conn->ep->wait);
-	return 0;
+	kfree(payload);
+	kfree(iov);
+	*off_out = off;
+	return ret;
 
-exit_unlock:
-	mutex_unlock(&conn->lock);
 exit:
-	kdbus_conn_queue_cleanup(queue);
-	kdbus_pool_free(conn->pool, off);
+	kfree(payload);
+	kfree(iov);
+	kdbus_pool_free(pool, off);
 	return ret;
 }
 
-static void kdbus_conn_scan_timeout(struct kdbus_conn *conn)
+/* Enqueue a message into the receiver's pool. A message with a deadline,
+ * or one which expects a reply if expect_reply is set, is tracked by the
+ * receiver. */
+int kdbus_conn_queue_insert(struct kdbus_conn *conn, struct kdbus_kmsg *kmsg,
+			    u64 deadline_ns, bool expect_reply)
 {
-	struct kdbus_conn_queue *queue, *tmp;
-	u64 deadline = -1;
-	struct timespec ts;
-	u64 now;
+	struct kdbus_conn_queue *queue;
+	ssize_t written;
+	size_t off;
+	int ret = 0;
+
+	if (conn->type != KDBUS_CONN_EP_CONNECTED)
+		return -ENOTCONN;
+
+	if (kmsg->fds && !(conn->flags & KDBUS_HELLO_ACCEPT_FD))
+		return -ECOMM;
+
+	queue = kzalloc(sizeof(struct kdbus_conn_queue), GFP_KERNEL);
+	if (!queue)
+		return -ENOMEM;
+
+	INIT_LIST_HEAD(&queue->entry);
+	INIT_LIST_HEAD(&queue->prio_entry);
+
+	/* copy message properties we need for the queue management */
+	queue->priority = kmsg->priority;
+	queue->cookie_reply = kmsg->msg.cookie_reply;
+	queue->src_id = kmsg->msg.src_id;
+	queue->reply_timeout =
+		kmsg->notification_type == KDBUS_MSG_REPLY_TIMEOUT;
+
+	if (deadline_ns || expect_reply) {
+		struct kdbus_conn_reply *reply;
+
+		reply = kzalloc(sizeof(struct kdbus_conn_reply), GFP_KERNEL);
+		if (!reply) {
+			ret = -ENOMEM;
+			goto exit_queue;
+		}
+
+		INIT_HLIST_NODE(&reply->hentry);
+		RB_CLEAR_NODE(&reply->deadline_node);
+		reply->queue = queue;
+		reply->src_id = kmsg->msg.src_id;
+		reply->cookie = kmsg->msg.cookie;
+		reply->deadline_ns = deadline_ns;
+		reply->expect_reply = expect_reply;
+		reply->sync = !!kmsg->call;
+		queue->reply = reply;
+	}
+
+	/* allocate the needed space in the pool of the receiver */
+	kdbus_conn_ring_sync(conn);
+	if (!capable(CAP_IPC_OWNER) &&
+	    atomic_read(&conn->msg_count) > KDBUS_CONN_MAX_MSGS) {
+		ret = -ENOBUFS;
+		goto exit_queue;
+	}
+
+	written = kdbus_conn_msg_write(conn->pool, queue, kmsg, &off);
+	if (written < 0) {
+		ret = written;
+		goto exit_queue;
+	}
+
+	/* remember the offset to the message */
+	queue->off = off;
+
+	/* The receive ring publishes the messages in the order of the
+	 * queue, the message is linked and published at once. Without
+	 * a ring, the message is handed over to the receiver lock-free. */
+	if (kdbus_pool_flags(conn->pool) & KDBUS_POOL_RING) {
+		u64 entry = off;
+
+		if (queue->fds_count > 0 || queue->memfds_count > 0)
+			entry |= KDBUS_POOL_RING_RECV;
+
+		mutex_lock(&conn->lock);
+		if (conn->type != KDBUS_CONN_EP_CONNECTED) {
+			mutex_unlock(&conn->lock);
+			ret = -ENOTCONN;
+			goto exit;
+		}
+
+		ret = kdbus_pool_ring_push(conn->pool, entry);
+		if (ret < 0) {
+			mutex_unlock(&conn->lock);
+			goto exit;
+		}
+		atomic_inc(&conn->msg_count);
+		kdbus_conn_queue_add(conn, queue);
+		mutex_unlock(&conn->lock);
+	} else {
+		atomic_inc(&conn->msg_count);
+		llist_add(&queue->incoming, &conn->msg_incoming);
+
+		/* The cleanup of the receiver marks it disconnected before
+		 * it takes the incoming messages for the last time. Either
+		 * it takes our message, or we see it disconnected, and drop
+		 * what was published after it, under conn->lock. The
+		 * message is no longer ours to touch. */
+		smp_mb();
+		if (ACCESS_ONCE(conn->type) != KDBUS_CONN_EP_CONNECTED) {
+			mutex_lock(&conn->lock);
+			kdbus_conn_incoming_flush(conn);
+			mutex_unlock(&conn->lock);
+			return -ENOTCONN;
+		}
+
+		/* the timeout work links the message into the tree of
+		 * deadlines, even if the receiver does not look at its
+		 * queue */
+		if (deadline_ns)
+			schedule_work(&conn->work);
+	}
+
+	/* Wake up poll(). A KDBUS_CMD_MSG_CALL and its reply wake the
+	 * receiver synchronously: the caller goes to sleep waiting for
+	 * the reply, the peer sending the reply usually goes back to wait
+	 * for the next call; the receiver takes over the CPU of the
+	 * sender instead of being moved to another one. */
+	if (kmsg->sync)
+		wake_up_interruptible_sync(&conn->wait);
+	else
+		wake_up_interruptible(&conn->wait);
+	return 0;
+
+exit:
+	kdbus_pool_free(conn->pool, off);
+exit_queue:
+	kdbus_conn_queue_cleanup(queue);
+	return ret;
+}
+
+/* Expire all tracked messages whose deadline has passed, in the order
+ * of their deadlines, and re-arm the timer for the next pending one.
+ * The senders of expired calls are notified, whether the call is still
+ * queued or was already received. */
+static void kdbus_conn_scan_timeout(struct kdbus_conn *conn)
+{
+	struct kdbus_conn_reply *reply, *tmp;
+	struct rb_node *n;
+	struct timespec ts;
+	LIST_HEAD(expired);
+	u64 now;
 
 	ktime_get_ts(&ts);
 	now = timespec_to_ns(&ts);
 
 	mutex_lock(&conn->lock);
-	list_for_each_entry_safe(queue, tmp, &conn->msg_list, entry) {
-		if (queue->deadline_ns == 0)
+	kdbus_conn_queue_splice(conn);
+	while ((n = rb_first(&conn->deadlines))) {
+		struct kdbus_conn_queue *queue;
+
+		reply = rb_entry(n, struct kdbus_conn_reply, deadline_node);
+		if (reply->deadline_ns > now) {
+			hrtimer_start(&conn->timer,
+				      ns_to_ktime(reply->deadline_ns),
+				      HRTIMER_MODE_ABS);
+			break;
+		}
+
+		queue = reply->queue;
+		kdbus_conn_reply_unlink(conn, reply);
+		list_add_tail(&reply->entry, &expired);
+
+		/* The message is published in the receive ring, the
+		 * receiver might already be reading it; keep it until
+		 * it is consumed. */
+		if (!queue || kdbus_pool_flags(conn->pool) & KDBUS_POOL_RING)
 			continue;
 
-		if (queue->deadline_ns <= now) {
-			if (queue->expect_reply)
-				kdbus_notify_reply_timeout(conn->ep,
-					queue->src_id, queue->cookie);
-			kdbus_pool_free(conn->pool, queue->off);
-			list_del(&queue->entry);
-			kdbus_conn_queue_cleanup(queue);
-		} else if (queue->deadline_ns < deadline) {
-			deadline = queue->deadline_ns;
-		}
+		kdbus_pool_free(conn->pool, queue->off);
+		kdbus_conn_queue_remove(conn, queue);
+		kdbus_conn_queue_cleanup(queue);
 	}
 	mutex_unlock(&conn->lock);
 
-	if (deadline != -1) {
-		u64 usecs = deadline - now;
-		do_div(usecs, 1000ULL);
-		mod_timer(&conn->timer, jiffies + usecs_to_jiffies(usecs));
+	if (!list_empty(&expired))
+		kdbus_conn_space_notify(conn);
+
+	/* the notification is queued to the sender, maybe to ourselves */
+	list_for_each_entry_safe(reply, tmp, &expired, entry) {
+		if (reply->expect_reply)
+			kdbus_notify_reply_timeout(conn->ep, reply->src_id,
+						   reply->cookie);
+		kfree(reply);
 	}
 }
 
@@ -490,15 +1103,22 @@ static void kdbus_conn_work(struct work_struct *work)
 	kdbus_conn_scan_timeout(conn);
 }
 
-static void kdbus_conn_timeout_schedule_scan(struct kdbus_conn *conn)
+/* the timer fires in interrupt context, the messages are expired from
+ * the work queue */
+static enum hrtimer_restart kdbus_conn_timer_func(struct hrtimer *timer)
 {
+	struct kdbus_conn *conn = container_of(timer, struct kdbus_conn,
+					       timer);
 	schedule_work(&conn->work);
+	return HRTIMER_NORESTART;
 }
 
-static void kdbus_conn_timer_func(unsigned long val)
+/* Pin a connection found under rcu_read_lock(), or a lock which keeps
+ * it from being freed; a connection whose last reference is already
+ * gone is about to be freed. */
+bool kdbus_conn_tryref(struct kdbus_conn *conn)
 {
-	struct kdbus_conn *conn = (struct kdbus_conn *) val;
-	kdbus_conn_timeout_schedule_scan(conn);
+	return kref_get_unless_zero(&conn->kref);
 }
 
 /* find and pin destination connection */
@@ -510,40 +1130,284 @@ static int kdbus_conn_get_conn_dst(struct kdbus_bus *bus,
 	struct kdbus_conn *c;
 	int ret = 0;
 
-	mutex_lock(&bus->lock);
-
 	if (msg->dst_id == KDBUS_DST_ID_WELL_KNOWN_NAME) {
-		const struct kdbus_name_entry *name_entry;
+		/* the owner of the name is pinned by the lookup */
+		c = kdbus_name_lookup_conn(bus->name_registry,
+					   kmsg->dst_name);
+		if (!c)
+			return -ESRCH;
 
-		name_entry = kdbus_name_lookup(bus->name_registry,
-					       kmsg->dst_name);
-		if (!name_entry) {
-			ret = -ESRCH;
-			goto exit_unlock;
-		}
-
-		c = name_entry->conn;
 		if ((msg->flags & KDBUS_MSG_FLAGS_NO_AUTO_START) &&
 		    (c->flags & KDBUS_HELLO_STARTER)) {
-			ret = -EADDRNOTAVAIL;
-			goto exit_unlock;
-		}
-	} else {
-		c = kdbus_bus_find_conn_by_id(bus, msg->dst_id);
-		if (!c) {
-			ret = -ENXIO;
-			goto exit_unlock;
+			kdbus_conn_unref(c);
+			return -EADDRNOTAVAIL;
 		}
+
+		*conn = c;
+		return 0;
+	}
+
+	rcu_read_lock();
+	c = kdbus_bus_find_conn_by_id(bus, msg->dst_id);
+	if (!c || !kdbus_conn_tryref(c)) {
+		ret = -ENXIO;
+		goto exit_unlock;
 	}
 
-	kdbus_conn_ref(c);
 	*conn = c;
 
 exit_unlock:
-	mutex_unlock(&bus->lock);
+	rcu_read_unlock();
 	return ret;
 }
 
+/* Queue a broadcast to the receivers, which all have a matching rule,
+ * and release the references to them. With append_meta, the metadata
+ * the receivers ask for is added on the way. */
+static void kdbus_conn_broadcast_deliver(struct kdbus_conn *conn_src,
+					 struct kdbus_kmsg *kmsg,
+					 struct kdbus_conn **conns,
+					 unsigned int count, bool append_meta)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		struct kdbus_conn *conn_dst = conns[i];
+
+		/* The first receiver which requests additional metadata
+		 * causes the message to carry it; all receivers after
+		 * that will see all of the added data, even when they
+		 * did not ask for it. */
+		if (append_meta)
+			kdbus_kmsg_append_meta(kmsg, conn_src, conn_dst);
+
+		kdbus_conn_queue_insert(conn_dst, kmsg, 0, false);
+		kdbus_conn_unref(conn_dst);
+	}
+}
+
+/* Look up the next batch of receivers of a broadcast, from the
+ * connection id *start on, and advance *start past it. The receivers
+ * are pinned and have a matching rule. Returns the number of receivers,
+ * 0 once all connections are looked at; connections which join during
+ * the broadcast may miss it. */
+static unsigned int kdbus_conn_broadcast_next(struct kdbus_bus *bus,
+					      struct kdbus_conn *conn_src,
+					      struct kdbus_kmsg *kmsg,
+					      unsigned long *start,
+					      struct kdbus_conn **conns)
+{
+	struct kdbus_conn *conn_dst;
+	unsigned int i, n, found;
+
+	do {
+		n = 0;
+		rcu_read_lock();
+		found = radix_tree_gang_lookup(&bus->conn_tree,
+					       (void **)conns, *start,
+					       KDBUS_CONN_BROADCAST_BATCH);
+		if (found > 0)
+			*start = conns[found - 1]->id + 1;
+
+		for (i = 0; i < found; i++) {
+			conn_dst = conns[i];
+
+			if (conn_dst->type != KDBUS_CONN_EP_CONNECTED)
+				continue;
+
+			if (conn_dst->id == kmsg->msg.src_id)
+				continue;
+
+			if (!kdbus_conn_tryref(conn_dst))
+				continue;
+
+			conns[n++] = conn_dst;
+		}
+		rcu_read_unlock();
+
+		/* only the receivers with a matching rule are kept */
+		for (i = 0, found = n, n = 0; i < found; i++) {
+			conn_dst = conns[i];
+
+			if (!kdbus_match_db_match_kmsg(conn_dst->match_db,
+						       conn_src, kmsg)) {
+				kdbus_conn_unref(conn_dst);
+				continue;
+			}
+
+			conns[n++] = conn_dst;
+		}
+	} while (n == 0 && found == KDBUS_CONN_BROADCAST_BATCH);
+
+	return n;
+}
+
+/* A broadcast delivered in parallel, shared by all shards. It is
+ * released by the last one who is done with it; the sender does not
+ * wait for the workers if it is killed. */
+struct kdbus_conn_broadcast {
+	struct kref kref;
+	struct kdbus_kmsg *kmsg;
+	struct mm_struct *mm;		/* the payload is read from the sender */
+	const struct cred *cred;	/* the sender's limits apply */
+	atomic_t pending;
+	struct completion done;
+};
+
+static void __kdbus_conn_broadcast_free(struct kref *kref)
+{
+	struct kdbus_conn_broadcast *b =
+		container_of(kref, struct kdbus_conn_broadcast, kref);
+
+	kdbus_kmsg_unref(b->kmsg);
+	mmput(b->mm);
+	put_cred(b->cred);
+	kfree(b);
+}
+
+/* a part of the receivers of a broadcast, delivered by a worker */
+struct kdbus_conn_broadcast_shard {
+	struct work_struct work;
+	struct list_head entry;
+	struct kdbus_conn_broadcast *b;
+	struct kdbus_conn *conns[KDBUS_CONN_BROADCAST_SHARD];
+	unsigned int count;
+};
+
+static void kdbus_conn_broadcast_work(struct work_struct *work)
+{
+	struct kdbus_conn_broadcast_shard *shard =
+		container_of(work, struct kdbus_conn_broadcast_shard, work);
+	struct kdbus_conn_broadcast *b = shard->b;
+	const struct cred *old_cred;
+
+	use_mm(b->mm);
+	old_cred = override_creds(b->cred);
+	kdbus_conn_broadcast_deliver(NULL, b->kmsg, shard->conns,
+				     shard->count, false);
+	revert_creds(old_cred);
+	unuse_mm(b->mm);
+	kfree(shard);
+
+	if (atomic_dec_and_test(&b->pending))
+		complete(&b->done);
+	kref_put(&b->kref, __kdbus_conn_broadcast_free);
+}
+
+/* Collect the receivers into shards and deliver them on the workqueue
+ * of the bus; the sender delivers the first shard itself. The metadata
+ * describes the sender and is added in its context, for all receivers
+ * at once. The workers copy the payload from the memory of the sender,
+ * which waits for all of them to finish, unless it is killed. If a
+ * shard cannot be allocated, the sender delivers the remaining
+ * receivers itself. */
+static void kdbus_conn_broadcast_parallel(struct kdbus_bus *bus,
+					  struct kdbus_conn *conn_src,
+					  struct kdbus_kmsg *kmsg)
+{
+	struct kdbus_conn *conns[KDBUS_CONN_BROADCAST_BATCH];
+	struct kdbus_conn_broadcast_shard *shard = NULL, *first, *tmp;
+	struct kdbus_conn_broadcast *b = NULL;
+	unsigned long start = 0;
+	unsigned int i, n, count = 0;
+	LIST_HEAD(shards);
+
+	while ((n = kdbus_conn_broadcast_next(bus, conn_src, kmsg,
+					      &start, conns))) {
+		for (i = 0; i < n; i++) {
+			if (!shard ||
+			    shard->count == KDBUS_CONN_BROADCAST_SHARD) {
+				shard = kmalloc(sizeof(*shard), GFP_KERNEL);
+				if (!shard)
+					break;
+
+				shard->count = 0;
+				list_add_tail(&shard->entry, &shards);
+				count++;
+			}
+
+			kdbus_kmsg_append_meta(kmsg, conn_src, conns[i]);
+			shard->conns[shard->count++] = conns[i];
+		}
+
+		kdbus_conn_broadcast_deliver(conn_src, kmsg, conns + i,
+					     n - i, true);
+	}
+
+	if (count == 0)
+		return;
+
+	if (count > 1)
+		b = kmalloc(sizeof(*b), GFP_KERNEL);
+
+	first = list_first_entry(&shards, struct kdbus_conn_broadcast_shard,
+				 entry);
+
+	/* without the shared state, the sender delivers all shards */
+	if (!b) {
+		list_for_each_entry_safe(shard, tmp, &shards, entry) {
+			kdbus_conn_broadcast_deliver(conn_src, kmsg,
+						     shard->conns,
+						     shard->count, false);
+			kfree(shard);
+		}
+		return;
+	}
+
+	kref_init(&b->kref);
+	b->kmsg = kdbus_kmsg_ref(kmsg);
+	b->mm = current->mm;
+	atomic_inc(&b->mm->mm_users);
+	b->cred = get_current_cred();
+	atomic_set(&b->pending, count - 1);
+	init_completion(&b->done);
+
+	/* a worker frees its shard when it is done */
+	list_for_each_entry_safe(shard, tmp, &shards, entry) {
+		if (shard == first)
+			continue;
+
+		kref_get(&b->kref);
+		shard->b = b;
+		INIT_WORK(&shard->work, kdbus_conn_broadcast_work);
+		queue_work(bus->broadcast_wq, &shard->work);
+	}
+
+	kdbus_conn_broadcast_deliver(conn_src, kmsg, first->conns,
+				     first->count, false);
+	kfree(first);
+
+	/* a killed sender leaves the workers behind, they own what
+	 * they need */
+	wait_for_completion_killable(&b->done);
+	kref_put(&b->kref, __kdbus_conn_broadcast_free);
+}
+
+/* Deliver a broadcast to all connections with a matching match rule.
+ * The connections are looked up and pinned in small batches under
+ * rcu_read_lock(), the messages are queued without holding any lock
+ * of the bus. A sender without user memory, like the kernel, or a
+ * message without a payload to copy, is always delivered serially. */
+static int kdbus_conn_broadcast(struct kdbus_ep *ep,
+				struct kdbus_conn *conn_src,
+				struct kdbus_kmsg *kmsg)
+{
+	struct kdbus_conn *conns[KDBUS_CONN_BROADCAST_BATCH];
+	unsigned long start = 0;
+	unsigned int n;
+
+	if (ep->bus->broadcast_wq && current->mm && kmsg->vecs_count > 0) {
+		kdbus_conn_broadcast_parallel(ep->bus, conn_src, kmsg);
+		return 0;
+	}
+
+	while ((n = kdbus_conn_broadcast_next(ep->bus, conn_src, kmsg,
+					      &start, conns)))
+		kdbus_conn_broadcast_deliver(conn_src, kmsg, conns, n, true);
+
+	return 0;
+}
+
 int kdbus_conn_kmsg_send(struct kdbus_ep *ep,
 			 struct kdbus_conn *conn_src,
 			 struct kdbus_kmsg *kmsg)
@@ -553,6 +1417,9 @@ int kdbus_conn_kmsg_send(struct kdbus_ep *ep,
 	struct kdbus_conn *conn;
 	u64 now_ns = 0;
 	u64 deadline_ns = 0;
+	long timeout = MAX_SCHEDULE_TIMEOUT;
+	bool is_reply = false;
+	bool sync = false;
 	int ret;
 
 	/* augment incoming message */
@@ -571,235 +1438,693 @@ int kdbus_conn_kmsg_send(struct kdbus_ep *ep,
 	}
 
 	/* broadcast message */
-	if (msg->dst_id == KDBUS_DST_ID_BROADCAST) {
-		unsigned int i;
+	if (msg->dst_id == KDBUS_DST_ID_BROADCAST)
+		return kdbus_conn_broadcast(ep, conn_src, kmsg);
+
+	/* direct message */
+	ret = kdbus_conn_get_conn_dst(ep->bus, kmsg, &conn_dst);
+	if (ret < 0) {
+		/* the caller is gone, it will not take the reply */
+		if (ret == -ENXIO && conn_src && msg->cookie_reply)
+			kdbus_conn_reply_complete(conn_src, msg->dst_id,
+						  msg->cookie_reply);
+		return ret;
+	}
+
+	/* Calls stay tracked by the called connection after they are
+	 * received, until they are answered or time out; they are
+	 * accounted to the caller. The count is only updated when a call
+	 * is linked into the queue of the called connection; the calls
+	 * not yet linked are bounded by the size of the queues. */
+	if (conn_src && (msg->flags & KDBUS_MSG_FLAGS_EXPECT_REPLY) &&
+	    !capable(CAP_IPC_OWNER) &&
+	    atomic_read(&conn_src->reply_count) >=
+	    KDBUS_CONN_MAX_REQUESTS_PENDING) {
+		ret = -EMLINK;
+		goto exit;
+	}
+
+	/* only the called connection can answer the call */
+	if (kmsg->call) {
+		mutex_lock(&conn_src->lock);
+		kmsg->call->dst_id = conn_dst->id;
+		mutex_unlock(&conn_src->lock);
+	}
+
+	if (msg->timeout_ns)
+		deadline_ns = now_ns + msg->timeout_ns;
+
+	/* a reply to a call we received passes the policy */
+	if (conn_src && msg->cookie_reply &&
+	    kdbus_conn_reply_check(conn_src, conn_dst->id,
+				   msg->cookie_reply, &sync))
+		is_reply = true;
+
+	if (ep->policy_db && conn_src && !is_reply) {
+		ret = kdbus_policy_db_check_send_access(ep->policy_db,
+							conn_src,
+							conn_dst,
+							deadline_ns);
+		if (ret < 0)
+			goto exit;
+	}
+
+	ret = kdbus_kmsg_append_meta(kmsg, conn_src, conn_dst);
+	if (ret < 0)
+		goto exit;
 
+	/* monitor connections get all messages; there are usually none,
+	 * do not take the lock of the bus for every message */
+	if (!list_empty(&ep->bus->monitors_list)) {
 		mutex_lock(&ep->bus->lock);
-		hash_for_each(ep->bus->conn_hash, i, conn_dst, hentry) {
-			if (conn_dst->type != KDBUS_CONN_EP_CONNECTED)
+		list_for_each_entry(conn, &ep->bus->monitors_list,
+				    monitor_entry) {
+			/* the monitor connection is addressed, deliver
+			 * it below */
+			if (conn->id == conn_dst->id)
 				continue;
 
-			if (conn_dst->id == msg->src_id)
-				continue;
+			/* ignore errors of misbehaving monitor connections */
+			kdbus_conn_queue_insert(conn, kmsg, 0, false);
+		}
+		mutex_unlock(&ep->bus->lock);
+	}
 
-			if (!kdbus_match_db_match_kmsg(conn_dst->match_db,
-						       conn_src, kmsg))
-				continue;
+	/* the called peer and the caller waiting for the reply are woken
+	 * in sync, not the monitors */
+	kmsg->sync = sync || kmsg->call;
 
-			/* The first receiver which requests additional
-			 * metadata causes the message to carry it; all
-			 * receivers after that will see all of the added
-			 * data, even when they did not ask for it. */
-			kdbus_kmsg_append_meta(kmsg, conn_src, conn_dst);
+	if (kmsg->send_timeout_ns) {
+		u64 usecs = kmsg->send_timeout_ns;
+
+		do_div(usecs, 1000ULL);
+		timeout = usecs_to_jiffies(usecs);
+	}
+
+	/* With KDBUS_MSG_SEND_TIMEOUT, the sender blocks while the
+	 * receiver is full, and tries again after the receiver freed
+	 * space. */
+	for (;;) {
+		int seq = atomic_read(&conn_dst->space_seq);
+
+		ret = kdbus_conn_queue_insert(conn_dst, kmsg, deadline_ns,
+				!!(msg->flags & KDBUS_MSG_FLAGS_EXPECT_REPLY));
+		if (!conn_src || (ret != -ENOBUFS && ret != -EXFULL))
+			break;
+
+		if (kdbus_conn_space_wait(conn_dst, conn_src, seq) < 0 ||
+		    !kmsg->send_block)
+			break;
+
+		/* wait for this receiver, whatever other receivers the
+		 * sender waits for */
+		timeout = wait_event_interruptible_timeout(conn_src->wait,
+				atomic_read(&conn_dst->space_seq) != seq,
+				timeout);
+
+		/* the receiver is still full, report why */
+		if (timeout == 0)
+			break;
 
-			kdbus_conn_queue_insert(conn_dst, kmsg, 0);
+		/* the message is not sent, it can be sent again */
+		if (timeout < 0) {
+			ret = -EINTR;
+			break;
 		}
-		mutex_unlock(&ep->bus->lock);
+	}
 
-		return ret;
+	/* the call is answered only if the reply could be queued, a
+	 * failed reply can be sent again; a caller which disconnected
+	 * will never take it */
+	if ((ret == 0 || ret == -ENOTCONN) && is_reply)
+		kdbus_conn_reply_complete(conn_src, conn_dst->id,
+					  msg->cookie_reply);
+
+exit:
+	kdbus_conn_unref(conn_dst);
+	return ret;
+}
+
+static int kdbus_conn_fds_install(struct kdbus_conn *conn,
+				  struct kdbus_conn_queue *queue)
+{
+	size_t size;
+	unsigned int i;
+	int *fds;
+	int ret;
+
+	/* get array of file descriptors */
+	size = queue->fds_count * sizeof(int);
+	fds = kmalloc(size, GFP_KERNEL);
+	if (!fds)
+		return -ENOMEM;
+
+	/* allocate new file descriptors in the receiver's process */
+	for (i = 0; i < queue->fds_count; i++) {
+		fds[i] = get_unused_fd();
+		if (fds[i] < 0) {
+			ret = fds[i];
+			goto remove_unused;
+		}
+	}
+
+	/* copy the array into the message item */
+	ret = kdbus_pool_write(conn->pool, queue->off + queue->fds, fds, size);
+	if (ret < 0)
+		goto remove_unused;
+
+	/* install files in the receiver's process */
+	for (i = 0; i < queue->fds_count; i++)
+		fd_install(fds[i], get_file(queue->fds_fp[i]));
+
+	kfree(fds);
+	return 0;
+
+remove_unused:
+	for (i = 0; i < queue->fds_count; i++) {
+		if (fds[i] < 0)
+			break;
+
+		put_unused_fd(fds[i]);
+	}
+
+	kfree(fds);
+	return ret;
+}
+
+static int kdbus_conn_memfds_install(struct kdbus_conn *conn,
+				     struct kdbus_conn_queue *queue,
+				     int **memfds)
+{
+	size_t size;
+	int *fds;
+	unsigned int i;
+	int ret = 0;
+
+	size = queue->memfds_count * sizeof(int);
+	fds = kmalloc(size, GFP_KERNEL);
+	if (!fds)
+		return -ENOMEM;
+
+	/* allocate new file descriptors in the receiver's process */
+	for (i = 0; i < queue->memfds_count; i++) {
+		fds[i] = get_unused_fd();
+		if (fds[i] < 0) {
+			ret = fds[i];
+			goto remove_unused;
+		}
+	}
+
+	/* Update the file descriptor number in the items. We remembered
+	 * the locations of the values in the buffer. */
+	for (i = 0; i < queue->memfds_count; i++) {
+		ret = kdbus_pool_write(conn->pool,
+				       queue->off + queue->memfds[i],
+				       &fds[i], sizeof(int));
+		if (ret < 0)
+			goto remove_unused;
+	}
+
+	/* install files in the receiver's process */
+	for (i = 0; i < queue->memfds_count; i++)
+		fd_install(fds[i], get_file(queue->memfds_fp[i]));
+
+	*memfds = fds;
+	return 0;
+
+remove_unused:
+	for (i = 0; i < queue->memfds_count; i++) {
+		if (fds[i] < 0)
+			break;
+
+		put_unused_fd(fds[i]);
+	}
+
+	kfree(fds);
+	*memfds = NULL;
+	return ret;
+}
+
+/* Hand out a queued message: return its offset in the pool and install
+ * its file descriptors. The message is moved to the given list, to be
+ * cleaned up after conn->lock is released. Called with conn->lock held. */
+static int kdbus_conn_recv_one(struct kdbus_conn *conn,
+			       struct kdbus_conn_queue *queue,
+			       __u64 __user *buf, struct list_head *done)
+{
+	int *memfds = NULL;
+	unsigned int i;
+	int ret;
+
+	/* return the address of the message in the pool */
+	if (put_user(queue->off, buf))
+		return -EFAULT;
+
+	/* Install KDBUS_MSG_PAYLOAD_MEMFDs file descriptors, we return
+	 * the list of file descriptors to be able to cleanup on error. */
+	if (queue->memfds_count > 0) {
+		ret = kdbus_conn_memfds_install(conn, queue, &memfds);
+		if (ret < 0)
+			return ret;
+	}
+
+	/* install KDBUS_MSG_FDS file descriptors */
+	if (queue->fds_count > 0) {
+		ret = kdbus_conn_fds_install(conn, queue);
+		if (ret < 0)
+			goto exit_rewind;
+	}
+
+	kfree(memfds);
+
+	kdbus_conn_queue_remove(conn, queue);
+	list_add_tail(&queue->entry, done);
+	if (kdbus_pool_flags(conn->pool) & KDBUS_POOL_RING)
+		kdbus_pool_ring_advance(conn->pool);
+	return 0;
+
+exit_rewind:
+	for (i = 0; i < queue->memfds_count; i++)
+		sys_close(memfds[i]);
+	kfree(memfds);
+	return ret;
+}
+
+/* clean up the handed out messages; they no longer count against the
+ * limit of queued messages */
+static void kdbus_conn_recv_done(struct kdbus_conn *conn,
+				 struct list_head *done)
+{
+	struct kdbus_conn_queue *queue, *tmp;
+
+	if (list_empty(done))
+		return;
+
+	list_for_each_entry_safe(queue, tmp, done, entry) {
+		list_del(&queue->entry);
+		kdbus_conn_queue_cleanup(queue);
+	}
+
+	kdbus_conn_space_notify(conn);
+}
+
+static int
+kdbus_conn_recv_msg(struct kdbus_conn *conn, __u64 __user *buf)
+{
+	LIST_HEAD(done);
+	int ret;
+
+	mutex_lock(&conn->lock);
+	kdbus_conn_ring_drain(conn);
+	kdbus_conn_queue_splice(conn);
+	if (list_empty(&conn->msg_list))
+		ret = -EAGAIN;
+	else
+		ret = kdbus_conn_recv_one(conn, kdbus_conn_queue_first(conn),
+					  buf, &done);
+	mutex_unlock(&conn->lock);
+
+	kdbus_conn_recv_done(conn, &done);
+	return ret;
+}
+
+/* receive up to as many messages as fit into the offsets array */
+static int
+kdbus_conn_recv_msg_batch(struct kdbus_conn *conn,
+			  struct kdbus_cmd_msg_batch __user *buf)
+{
+	LIST_HEAD(done);
+	u64 size, n, i;
+	int ret = 0;
+
+	if (kdbus_size_get_user(&size, buf, struct kdbus_cmd_msg_batch))
+		return -EFAULT;
+
+	if (size < sizeof(struct kdbus_cmd_msg_batch) ||
+	    size > KDBUS_MSG_MAX_BATCH_SIZE)
+		return -EMSGSIZE;
+
+	n = (size - sizeof(struct kdbus_cmd_msg_batch)) / sizeof(__u64);
+	if (n == 0)
+		return -EINVAL;
+
+	mutex_lock(&conn->lock);
+	kdbus_conn_ring_drain(conn);
+	kdbus_conn_queue_splice(conn);
+	for (i = 0; i < n && !list_empty(&conn->msg_list); i++) {
+		ret = kdbus_conn_recv_one(conn, kdbus_conn_queue_first(conn),
+					  &buf->offsets[i], &done);
+		if (ret < 0)
+			break;
+	}
+	mutex_unlock(&conn->lock);
+
+	kdbus_conn_recv_done(conn, &done);
+
+	/* report the messages we handed out before an error */
+	if (i == 0)
+		return ret < 0 ? ret : -EAGAIN;
+
+	if (put_user(i, &buf->count))
+		return -EFAULT;
+
+	return 0;
+}
+
+/* hand out the reply to the given cookie, if it is queued */
+static int kdbus_conn_recv_reply(struct kdbus_conn *conn,
+				 struct kdbus_conn_call *call,
+				 __u64 __user *buf)
+{
+	LIST_HEAD(done);
+	int ret = -EAGAIN;
+
+	mutex_lock(&conn->lock);
+	kdbus_conn_queue_splice(conn);
+	if (call->queue && call->queue->reply_timeout) {
+		/* the deadline of the call passed in the kernel; the
+		 * caller gets the same error as for its own timeout */
+		atomic_dec(&conn->msg_count);
+		kdbus_pool_free(conn->pool, call->queue->off);
+		kdbus_conn_queue_cleanup(call->queue);
+		call->queue = NULL;
+		ret = -ETIMEDOUT;
+	} else if (call->queue) {
+		ret = kdbus_conn_recv_one(conn, call->queue, buf, &done);
+		if (ret == 0)
+			call->queue = NULL;
+	}
+	mutex_unlock(&conn->lock);
+
+	kdbus_conn_recv_done(conn, &done);
+	return ret;
+}
+
+/* Stop waiting for the reply of a call. A reply which is already linked
+ * but could not be handed out goes back into the queue; the reply of a
+ * call which is given up is dropped when it arrives. */
+static void kdbus_conn_call_finish(struct kdbus_conn *conn,
+				   struct kdbus_conn_call *call, bool cancel)
+{
+	mutex_lock(&conn->lock);
+	kdbus_conn_queue_splice(conn);
+	if (call->queue) {
+		if (cancel) {
+			atomic_dec(&conn->msg_count);
+			kdbus_pool_free(conn->pool, call->queue->off);
+			kdbus_conn_queue_cleanup(call->queue);
+		} else {
+			kdbus_conn_queue_add(conn, call->queue);
+		}
+		call->queue = NULL;
+	} else if (cancel) {
+		call->cancelled = true;
+		call = NULL;
 	}
 
-	/* direct message */
-	ret = kdbus_conn_get_conn_dst(ep->bus, kmsg, &conn_dst);
+	if (call) {
+		list_del(&call->entry);
+		kfree(call);
+	}
+	mutex_unlock(&conn->lock);
+}
+
+/* Send a method call and wait for its reply, a KDBUS_MSG_REPLY_DEAD
+ * notification, or the timeout of the message to pass. The reply is
+ * handed out like with KDBUS_CMD_MSG_RECV. A passed timeout fails with
+ * ETIMEDOUT, whether the kernel's KDBUS_MSG_REPLY_TIMEOUT notification
+ * or the wait of the caller notices it first. */
+static int kdbus_conn_call(struct kdbus_conn *conn,
+			   struct kdbus_cmd_msg_call __user *buf)
+{
+	struct kdbus_cmd_msg_call cmd;
+	struct kdbus_conn_call *call;
+	struct kdbus_kmsg *kmsg;
+	long timeout = MAX_SCHEDULE_TIMEOUT;
+	bool cancel = false;
+	int ret;
+
+	/* the receive ring hands out messages only in queue order */
+	if (kdbus_pool_flags(conn->pool) & KDBUS_POOL_RING)
+		return -ENOTSUPP;
+
+	if (copy_from_user(&cmd, buf, sizeof(cmd)))
+		return -EFAULT;
+
+	if (!KDBUS_IS_ALIGNED8(cmd.msg_address))
+		return -EFAULT;
+
+	ret = kdbus_kmsg_new_from_user(conn, KDBUS_PTR(cmd.msg_address),
+				       &kmsg);
 	if (ret < 0)
 		return ret;
 
-	if (msg->timeout_ns)
-		deadline_ns = now_ns + msg->timeout_ns;
-
-	if (ep->policy_db && conn_src) {
-		ret = kdbus_policy_db_check_send_access(ep->policy_db,
-							conn_src,
-							conn_dst,
-							deadline_ns);
-		if (ret < 0)
-			goto exit;
+	if (kmsg->msg.dst_id == KDBUS_DST_ID_BROADCAST) {
+		ret = -ENOTUNIQ;
+		goto exit_free;
 	}
 
-	ret = kdbus_kmsg_append_meta(kmsg, conn_src, conn_dst);
-	if (ret < 0)
-		goto exit;
+	call = kzalloc(sizeof(struct kdbus_conn_call), GFP_KERNEL);
+	if (!call) {
+		ret = -ENOMEM;
+		goto exit_free;
+	}
 
-	/* monitor connections get all messages */
-	mutex_lock(&ep->bus->lock);
-	list_for_each_entry(conn, &ep->bus->monitors_list, monitor_entry) {
-		/* the monitor connection is addressed, deliver it below */
-		if (conn->id == conn_dst->id)
-			continue;
+	kmsg->msg.flags |= KDBUS_MSG_FLAGS_EXPECT_REPLY;
+	kmsg->call = call;
+	call->cookie = kmsg->msg.cookie;
+	if (kmsg->msg.timeout_ns) {
+		u64 usecs = kmsg->msg.timeout_ns;
 
-		/* ignore errors of misbehaving monitor connections */
-		kdbus_conn_queue_insert(conn, kmsg, 0);
+		do_div(usecs, 1000ULL);
+		timeout = usecs_to_jiffies(usecs);
 	}
-	mutex_unlock(&ep->bus->lock);
-
-	ret = kdbus_conn_queue_insert(conn_dst, kmsg, deadline_ns);
-	if (ret < 0)
-		goto exit;
 
-	if (msg->timeout_ns)
-		kdbus_conn_timeout_schedule_scan(conn_dst);
+	/* the reply can arrive before the send returns */
+	mutex_lock(&conn->lock);
+	list_add_tail(&call->entry, &conn->calls);
+	mutex_unlock(&conn->lock);
 
-exit:
-	kdbus_conn_unref(conn_dst);
-	return ret;
-}
+	ret = kdbus_conn_kmsg_send(conn->ep, conn, kmsg);
+	if (ret < 0) {
+		kdbus_conn_call_finish(conn, call, false);
+		goto exit_free;
+	}
 
-static int kdbus_conn_fds_install(struct kdbus_conn *conn,
-				  struct kdbus_conn_queue *queue)
-{
-	size_t size;
-	unsigned int i;
-	int *fds;
-	int ret;
+	/* the reply is taken out of the queue by whoever links it, and
+	 * wakes us up */
+	for (;;) {
+		ret = kdbus_conn_recv_reply(conn, call, &buf->reply_offset);
+		if (ret != -EAGAIN)
+			break;
 
-	/* get array of file descriptors */
-	size = queue->fds_count * sizeof(int);
-	fds = kmalloc(size, GFP_KERNEL);
-	if (!fds)
-		return -ENOMEM;
+		timeout = wait_event_interruptible_timeout(conn->wait,
+				ACCESS_ONCE(call->queue) ||
+				!llist_empty(&conn->msg_incoming), timeout);
+		if (timeout == 0) {
+			ret = -ETIMEDOUT;
+			cancel = true;
+			break;
+		}
 
-	/* allocate new file descriptors in the receiver's process */
-	for (i = 0; i < queue->fds_count; i++) {
-		fds[i] = get_unused_fd();
-		if (fds[i] < 0) {
-			ret = fds[i];
-			goto remove_unused;
+		/* the call is not restarted, it would send again */
+		if (timeout < 0) {
+			ret = -EINTR;
+			cancel = true;
+			break;
 		}
 	}
 
-	/* copy the array into the message item */
-	ret = kdbus_pool_write(conn->pool, queue->off + queue->fds, fds, size);
-	if (ret < 0)
-		goto remove_unused;
+	kdbus_conn_call_finish(conn, call, cancel);
 
-	/* install files in the receiver's process */
-	for (i = 0; i < queue->fds_count; i++)
-		fd_install(fds[i], get_file(queue->fds_fp[i]));
+exit_free:
+	kdbus_kmsg_unref(kmsg);
+	return ret;
+}
 
-	kfree(fds);
-	return 0;
+/* release all messages in the offsets array */
+static int
+kdbus_conn_release_msg_batch(struct kdbus_conn *conn,
+			     struct kdbus_cmd_msg_batch __user *buf)
+{
+	struct kdbus_cmd_msg_batch *cmd;
+	u64 size;
+	int ret = 0;
 
-remove_unused:
-	for (i = 0; i < queue->fds_count; i++) {
-		if (fds[i] < 0)
-			break;
+	if (kdbus_size_get_user(&size, buf, struct kdbus_cmd_msg_batch))
+		return -EFAULT;
 
-		put_unused_fd(fds[i]);
+	if (size < sizeof(struct kdbus_cmd_msg_batch) ||
+	    size > KDBUS_MSG_MAX_BATCH_SIZE)
+		return -EMSGSIZE;
+
+	cmd = memdup_user(buf, size);
+	if (IS_ERR(cmd))
+		return PTR_ERR(cmd);
+
+	if (cmd->count > (size - sizeof(struct kdbus_cmd_msg_batch)) /
+			 sizeof(__u64)) {
+		ret = -EINVAL;
+		goto exit_free;
 	}
 
-	kfree(fds);
+	/* release every valid offset; report the last error */
+	kdbus_conn_ring_sync(conn);
+	ret = kdbus_pool_free_batch(conn->pool, cmd->offsets, cmd->count);
+	kdbus_conn_space_notify(conn);
+
+exit_free:
+	kfree(cmd);
 	return ret;
 }
 
-static int kdbus_conn_memfds_install(struct kdbus_conn *conn,
-				     struct kdbus_conn_queue *queue,
-				     int **memfds)
+/* register or unregister the submission ring of the sender */
+static int kdbus_conn_submit_ring_set(struct kdbus_conn *conn,
+				      void __user *buf)
 {
-	size_t size;
-	int *fds;
-	unsigned int i;
+	struct kdbus_cmd_submit_ring cmd;
 	int ret = 0;
 
-	size = queue->memfds_count * sizeof(int);
-	fds = kmalloc(size, GFP_KERNEL);
-	if (!fds)
-		return -ENOMEM;
+	if (copy_from_user(&cmd, buf, sizeof(cmd)))
+		return -EFAULT;
 
-	/* allocate new file descriptors in the receiver's process */
-	for (i = 0; i < queue->memfds_count; i++) {
-		fds[i] = get_unused_fd();
-		if (fds[i] < 0) {
-			ret = fds[i];
-			goto remove_unused;
-		}
+	mutex_lock(&conn->submit_lock);
+	if (cmd.ring == 0) {
+		conn->submit_ring = NULL;
+		conn->submit_sq = NULL;
+		conn->submit_cq = NULL;
+		conn->submit_count = 0;
+		goto exit_unlock;
 	}
 
-	/* Update the file descriptor number in the items. We remembered
-	 * the locations of the values in the buffer. */
-	for (i = 0; i < queue->memfds_count; i++) {
-		ret = kdbus_pool_write(conn->pool,
-				       queue->off + queue->memfds[i],
-				       &fds[i], sizeof(int));
-		if (ret < 0)
-			goto remove_unused;
+	if (cmd.count == 0 || cmd.count > KDBUS_CONN_MAX_SUBMIT) {
+		ret = -EINVAL;
+		goto exit_unlock;
 	}
 
-	/* install files in the receiver's process */
-	for (i = 0; i < queue->memfds_count; i++)
-		fd_install(fds[i], get_file(queue->memfds_fp[i]));
+	if (!KDBUS_IS_ALIGNED8(cmd.ring) ||
+	    !KDBUS_IS_ALIGNED8(cmd.sq) ||
+	    !KDBUS_IS_ALIGNED8(cmd.cq)) {
+		ret = -EFAULT;
+		goto exit_unlock;
+	}
 
-	*memfds = fds;
-	return 0;
+	if (!access_ok(VERIFY_WRITE, KDBUS_PTR(cmd.ring),
+		       sizeof(struct kdbus_submit_ring)) ||
+	    !access_ok(VERIFY_READ, KDBUS_PTR(cmd.sq),
+		       cmd.count * sizeof(u64)) ||
+	    !access_ok(VERIFY_WRITE, KDBUS_PTR(cmd.cq),
+		       cmd.count * sizeof(struct kdbus_submit_completion))) {
+		ret = -EFAULT;
+		goto exit_unlock;
+	}
 
-remove_unused:
-	for (i = 0; i < queue->memfds_count; i++) {
-		if (fds[i] < 0)
-			break;
+	conn->submit_ring = KDBUS_PTR(cmd.ring);
+	conn->submit_sq = KDBUS_PTR(cmd.sq);
+	conn->submit_cq = KDBUS_PTR(cmd.cq);
+	conn->submit_count = cmd.count;
 
-		put_unused_fd(fds[i]);
+	/* continue from the current state of the ring */
+	if (get_user(conn->submit_sq_tail, &conn->submit_ring->sq_tail) ||
+	    get_user(conn->submit_cq_head, &conn->submit_ring->cq_head)) {
+		conn->submit_ring = NULL;
+		ret = -EFAULT;
 	}
 
-	kfree(fds);
-	*memfds = NULL;
+exit_unlock:
+	mutex_unlock(&conn->submit_lock);
 	return ret;
 }
 
-static int
-kdbus_conn_recv_msg(struct kdbus_conn *conn, __u64 __user *buf)
+/* Send all messages queued in the submission ring, and post a completion
+ * for every one of them. Returns the number of processed messages. */
+static int kdbus_conn_submit(struct kdbus_conn *conn)
 {
-	struct kdbus_conn_queue *queue;
-	u64 off;
-	int *memfds = NULL;
-	unsigned int i;
-	int ret;
+	struct kdbus_submit_ring __user *ring;
+	u64 sq_head, cq_tail;
+	int count = 0;
+	int ret = 0;
 
-	mutex_lock(&conn->lock);
-	if (conn->msg_count == 0) {
-		ret = -EAGAIN;
+	mutex_lock(&conn->submit_lock);
+	ring = conn->submit_ring;
+	if (!ring) {
+		ret = -ENXIO;
 		goto exit_unlock;
 	}
 
-	/* return the address of the next message in the pool */
-	queue = list_first_entry(&conn->msg_list,
-				 struct kdbus_conn_queue, entry);
-	off = queue->off;
-	if (copy_to_user(buf, &off, sizeof(__u64))) {
+	if (get_user(sq_head, &ring->sq_head) ||
+	    get_user(cq_tail, &ring->cq_tail)) {
 		ret = -EFAULT;
 		goto exit_unlock;
 	}
 
-	/* Install KDBUS_MSG_PAYLOAD_MEMFDs file descriptors, we return
-	 * the list of file descriptors to be able to cleanup on error. */
-	if (queue->memfds_count > 0) {
-		ret = kdbus_conn_memfds_install(conn, queue, &memfds);
-		if (ret < 0)
-			goto exit_unlock;
+	/* do not run past the entries submitted by userspace */
+	if (sq_head - conn->submit_sq_tail > conn->submit_count) {
+		ret = -EINVAL;
+		goto exit_unlock;
 	}
 
-	/* install KDBUS_MSG_FDS file descriptors */
-	if (queue->fds_count > 0) {
-		ret = kdbus_conn_fds_install(conn, queue);
-		if (ret < 0)
-			goto exit_rewind;
-	}
+	while (conn->submit_sq_tail != sq_head) {
+		struct kdbus_submit_completion completion = {};
+		struct kdbus_msg __user *msg;
+		struct kdbus_kmsg *kmsg;
+		size_t pos;
+		u64 addr;
 
-	kfree(memfds);
+		/* the completion ring is full */
+		if (conn->submit_cq_head - cq_tail >= conn->submit_count)
+			break;
 
-	conn->msg_count--;
-	list_del(&queue->entry);
-	mutex_unlock(&conn->lock);
+		pos = conn->submit_sq_tail % conn->submit_count;
+		if (get_user(addr, &conn->submit_sq[pos])) {
+			ret = -EFAULT;
+			break;
+		}
 
-	kdbus_conn_queue_cleanup(queue);
-	return 0;
+		msg = KDBUS_PTR(addr);
+		if (!KDBUS_IS_ALIGNED8(addr)) {
+			/* like MSG_SEND, do not read a misaligned message */
+			ret = -EFAULT;
+		} else {
+			ret = kdbus_kmsg_new_from_user(conn, msg, &kmsg);
+			if (ret == 0) {
+				completion.cookie = kmsg->msg.cookie;
+				ret = kdbus_conn_kmsg_send(conn->ep, conn,
+							   kmsg);
+				kdbus_kmsg_unref(kmsg);
+			} else if (get_user(completion.cookie,
+					    &msg->cookie)) {
+				completion.cookie = 0;
+			}
+		}
+		completion.ret = ret;
 
-exit_rewind:
-	for (i = 0; i < queue->memfds_count; i++)
-		sys_close(memfds[i]);
-	kfree(memfds);
+		/* the entry is consumed, it must not be sent again, even
+		 * if its completion cannot be posted */
+		conn->submit_sq_tail++;
+		count++;
+
+		pos = conn->submit_cq_head % conn->submit_count;
+		if (copy_to_user(&conn->submit_cq[pos], &completion,
+				 sizeof(completion))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		conn->submit_cq_head++;
+		ret = 0;
+	}
+
+	if (put_user(conn->submit_sq_tail, &ring->sq_tail) ||
+	    put_user(conn->submit_cq_head, &ring->cq_head))
+		ret = -EFAULT;
 
 exit_unlock:
-	mutex_unlock(&conn->lock);
-	return ret;
+	mutex_unlock(&conn->submit_lock);
+	if (ret < 0)
+		return ret;
+
+	return count;
 }
 
 int kdbus_conn_accounting_add_size(struct kdbus_conn *conn, size_t size)
@@ -912,45 +2237,53 @@ exit_unlock:
 
 static void kdbus_conn_cleanup(struct kdbus_conn *conn)
 {
-	struct kdbus_conn_queue *queue, *tmp;
+	struct kdbus_conn_reply *reply, *reply_tmp;
+	struct hlist_node *node_tmp;
 	struct list_head list;
+	unsigned int i;
 
 	INIT_LIST_HEAD(&list);
 
 	/* remove from bus */
 	mutex_lock(&conn->ep->bus->lock);
-	hash_del(&conn->hentry);
+	radix_tree_delete(&conn->ep->bus->conn_tree, conn->id);
+	conn->ep->bus->conn_count--;
 	list_del(&conn->monitor_entry);
-	conn->type = KDBUS_CONN_EP_DISCONNECTED;
 	mutex_unlock(&conn->ep->bus->lock);
 
-	/* clean up any messages still left on this endpoint */
+	/* Senders check the state under conn->lock, or after they
+	 * published their message; what is published after the splice
+	 * below is dropped by the sender. */
 	mutex_lock(&conn->lock);
-	list_for_each_entry_safe(queue, tmp, &conn->msg_list, entry) {
-		list_del(&queue->entry);
+	conn->type = KDBUS_CONN_EP_DISCONNECTED;
+	smp_mb();
 
-		/* we cannot hold "lock" and enqueue new messages with
-		 * kdbus_notify_reply_dead(); move these messages
-		 * into a temporary list and handle them below */
-		if (queue->src_id != conn->id && queue->expect_reply) {
-			list_add_tail(&queue->entry, &list);
-		} else {
-			kdbus_pool_free(conn->pool, queue->off);
-			kdbus_conn_queue_cleanup(queue);
-		}
+	/* clean up any messages still left on this endpoint */
+	kdbus_conn_queue_flush(conn);
+
+	/* we cannot hold "lock" and enqueue new messages with
+	 * kdbus_notify_reply_dead(); move the calls still waiting for
+	 * a reply, queued or received, into a temporary list and handle
+	 * them below */
+	hash_for_each_safe(conn->reply_hash, i, node_tmp, reply, hentry) {
+		kdbus_conn_reply_unlink(conn, reply);
+		if (reply->src_id != conn->id)
+			list_add_tail(&reply->entry, &list);
+		else
+			kfree(reply);
 	}
 	mutex_unlock(&conn->lock);
 
-	list_for_each_entry_safe(queue, tmp, &list, entry) {
-		kdbus_notify_reply_dead(conn->ep, queue->src_id,
-					queue->cookie);
-		mutex_lock(&conn->lock);
-		kdbus_pool_free(conn->pool, queue->off);
-		mutex_unlock(&conn->lock);
-		kdbus_conn_queue_cleanup(queue);
+	list_for_each_entry_safe(reply, reply_tmp, &list, entry) {
+		kdbus_notify_reply_dead(conn->ep, reply->src_id,
+					reply->cookie);
+		kfree(reply);
 	}
 
-	del_timer(&conn->timer);
+	/* senders waiting for space will find us gone */
+	kdbus_conn_space_notify(conn);
+
+	hrtimer_cancel(&conn->timer);
 	cancel_work_sync(&conn->work);
 #ifdef CONFIG_SECURITY
 	security_release_secctx(conn->sec_label, conn->sec_label_len);
@@ -958,17 +2291,39 @@ static void kdbus_conn_cleanup(struct kdbus_conn *conn)
 	kdbus_name_remove_by_conn(conn->ep->bus->name_registry, conn);
 	if (conn->ep->policy_db)
 		kdbus_policy_db_remove_conn(conn->ep->policy_db, conn);
-	kdbus_match_db_unref(conn->match_db);
 	kdbus_ep_unref(conn->ep);
-
-	kdbus_pool_cleanup(conn->pool);
 }
 
+/* Senders which found the connection before it was unlinked from the
+ * bus might still use its match rules and its pool; they are released
+ * with the last reference, the memory after an RCU grace period. A
+ * sender might have scheduled the timeout work after the cleanup; it
+ * is stopped before the memory goes away. */
 static void __kdbus_conn_free(struct kref *kref)
 {
 	struct kdbus_conn *conn = container_of(kref, struct kdbus_conn, kref);
 
-	kfree(conn);
+	if (conn->pool) {
+		struct kdbus_conn_reply *reply;
+		struct hlist_node *tmp;
+		unsigned int i;
+
+		hrtimer_cancel(&conn->timer);
+		cancel_work_sync(&conn->work);
+
+		/* whatever a sender left behind after the cleanup */
+		kdbus_conn_queue_flush(conn);
+		hash_for_each_safe(conn->reply_hash, i, tmp, reply, hentry) {
+			kdbus_conn_reply_unlink(conn, reply);
+			kfree(reply);
+		}
+	}
+
+	if (conn->match_db)
+		kdbus_match_db_unref(conn->match_db);
+	kdbus_meta_cache_free(conn->meta_cache);
+	kdbus_pool_cleanup(conn->pool);
+	kfree_rcu(conn, rcu);
 }
 
 struct kdbus_conn *kdbus_conn_ref(struct kdbus_conn *conn)
@@ -1166,6 +2521,8 @@ static long kdbus_conn_ioctl_ep(struct file *file, unsigned int cmd,
 
 	case KDBUS_CMD_HELLO: {
 		/* turn this fd into a connection. */
+		unsigned int pool_flags;
+		unsigned int i;
 		size_t size;
 		void *v;
 
@@ -1203,25 +2560,46 @@ static long kdbus_conn_ioctl_ep(struct file *file, unsigned int cmd,
 			break;
 		}
 
-		ret = kdbus_pool_init(&conn->pool, hello->pool_size);
+		pool_flags = 0;
+		if (hello->conn_flags & KDBUS_HELLO_POOL_HUGEPAGE)
+			pool_flags |= KDBUS_POOL_HUGEPAGE;
+		if (hello->conn_flags & KDBUS_HELLO_POOL_LOCKED)
+			pool_flags |= KDBUS_POOL_LOCKED;
+		if (hello->conn_flags & KDBUS_HELLO_POOL_RING)
+			pool_flags |= KDBUS_POOL_RING;
+
+		ret = kdbus_pool_init(&conn->pool, hello->pool_size,
+				      pool_flags);
 		if (ret < 0)
 			break;
 
+		/* tell the caller about the pool properties which
+		 * are not available, and we fell back from */
+		if (!(kdbus_pool_flags(conn->pool) & KDBUS_POOL_HUGEPAGE))
+			hello->conn_flags &= ~KDBUS_HELLO_POOL_HUGEPAGE;
+
 		mutex_init(&conn->lock);
 		mutex_init(&conn->names_lock);
 		mutex_init(&conn->accounting_lock);
+		mutex_init(&conn->submit_lock);
+		mutex_init(&conn->meta_lock);
+		init_waitqueue_head(&conn->wait);
+		INIT_LIST_HEAD(&conn->space_waiters);
+		init_llist_head(&conn->msg_incoming);
 		INIT_LIST_HEAD(&conn->msg_list);
+		for (i = 0; i < ARRAY_SIZE(conn->msg_prio_list); i++)
+			INIT_LIST_HEAD(&conn->msg_prio_list[i]);
 		INIT_LIST_HEAD(&conn->names_list);
 		INIT_LIST_HEAD(&conn->names_queue_list);
 		INIT_LIST_HEAD(&conn->monitor_entry);
+		INIT_LIST_HEAD(&conn->calls);
 
 		INIT_WORK(&conn->work, kdbus_conn_work);
 
-		init_timer(&conn->timer);
-		conn->timer.expires = 0;
+		conn->deadlines = RB_ROOT;
+		hash_init(conn->reply_hash);
+		hrtimer_init(&conn->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
 		conn->timer.function = kdbus_conn_timer_func;
-		conn->timer.data = (unsigned long) conn;
-		add_timer(&conn->timer);
 
 		conn->match_db = kdbus_match_db_new();
 
@@ -1239,8 +2617,16 @@ static long kdbus_conn_ioctl_ep(struct file *file, unsigned int cmd,
 		/* link into bus; get new id for this connection */
 		mutex_lock(&conn->ep->bus->lock);
 		conn->id = conn->ep->bus->conn_id_next++;
-		hash_add(conn->ep->bus->conn_hash, &conn->hentry, conn->id);
+		if (conn->id == (unsigned long)conn->id)
+			ret = radix_tree_insert(&conn->ep->bus->conn_tree,
+						conn->id, conn);
+		else
+			ret = -ENOSPC;
+		if (ret == 0)
+			conn->ep->bus->conn_count++;
 		mutex_unlock(&conn->ep->bus->lock);
+		if (ret < 0)
+			break;
 
 		/* return properties of this connection to the caller */
 		hello->bus_flags = bus->bus_flags;
@@ -1378,22 +2764,24 @@ static long kdbus_conn_ioctl_ep_connected(struct file *file, unsigned int cmd,
 		}
 
 		/* privileged users can act on behalf of someone else */
-		if (cmd_monitor.id == 0) {
-			mconn = conn;
-		} else if (cmd_monitor.id != conn->id) {
-			if (!kdbus_bus_uid_is_privileged(bus)) {
-				ret = -EPERM;
-				break;
-			}
+		if (cmd_monitor.id != 0 && cmd_monitor.id != conn->id &&
+		    !kdbus_bus_uid_is_privileged(bus)) {
+			ret = -EPERM;
+			break;
+		}
 
+		/* the connection cannot be unlinked from the bus while
+		 * we hold its lock */
+		mutex_lock(&bus->lock);
+		if (cmd_monitor.id != 0 && cmd_monitor.id != conn->id) {
 			mconn = kdbus_bus_find_conn_by_id(bus, cmd_monitor.id);
 			if (!mconn) {
+				mutex_unlock(&bus->lock);
 				ret = -ENXIO;
 				break;
 			}
 		}
 
-		mutex_lock(&bus->lock);
 		if (cmd_monitor.enable)
 			list_add_tail(&mconn->monitor_entry, &bus->monitors_list);
 		else
@@ -1416,7 +2804,7 @@ static long kdbus_conn_ioctl_ep_connected(struct file *file, unsigned int cmd,
 			break;
 
 		ret = kdbus_conn_kmsg_send(conn->ep, conn, kmsg);
-		kdbus_kmsg_free(kmsg);
+		kdbus_kmsg_unref(kmsg);
 		break;
 	}
 
@@ -1445,12 +2833,58 @@ static long kdbus_conn_ioctl_ep_connected(struct file *file, unsigned int cmd,
 			break;
 		}
 
-		mutex_lock(&conn->lock);
+		kdbus_conn_ring_sync(conn);
 		ret = kdbus_pool_free(conn->pool, off);
-		mutex_unlock(&conn->lock);
+		if (ret == 0)
+			kdbus_conn_space_notify(conn);
 		break;
 	}
 
+	case KDBUS_CMD_MSG_RECV_BATCH:
+		/* receive pointers to many queued messages */
+		if (!KDBUS_IS_ALIGNED8((uintptr_t)buf)) {
+			ret = -EFAULT;
+			break;
+		}
+
+		ret = kdbus_conn_recv_msg_batch(conn, buf);
+		break;
+
+	case KDBUS_CMD_MSG_RELEASE_BATCH:
+		/* free the memory of many messages in the pool */
+		if (!KDBUS_IS_ALIGNED8((uintptr_t)buf)) {
+			ret = -EFAULT;
+			break;
+		}
+
+		ret = kdbus_conn_release_msg_batch(conn, buf);
+		break;
+
+	case KDBUS_CMD_MSG_CALL:
+		/* send a method call and receive its reply */
+		if (!KDBUS_IS_ALIGNED8((uintptr_t)buf)) {
+			ret = -EFAULT;
+			break;
+		}
+
+		ret = kdbus_conn_call(conn, buf);
+		break;
+
+	case KDBUS_CMD_MSG_SUBMIT_RING:
+		/* register the submission ring */
+		if (!KDBUS_IS_ALIGNED8((uintptr_t)buf)) {
+			ret = -EFAULT;
+			break;
+		}
+
+		ret = kdbus_conn_submit_ring_set(conn, buf);
+		break;
+
+	case KDBUS_CMD_MSG_SUBMIT:
+		/* send the messages queued in the submission ring */
+		ret = kdbus_conn_submit(conn);
+		break;
+
 	case KDBUS_CMD_MEMFD_NEW: {
 		int fd;
 		int __user *addr = buf;
@@ -1503,12 +2937,20 @@ static unsigned int kdbus_conn_poll(struct file *file,
 	if (conn->type != KDBUS_CONN_EP_CONNECTED)
 		return POLLERR | POLLHUP;
 
-	poll_wait(file, &conn->ep->wait, wait);
+	poll_wait(file, &conn->wait, wait);
 
-	mutex_lock(&conn->lock);
-	if (!list_empty(&conn->msg_list))
+	/* The readiness is published with the depth of the queue and
+	 * of the receive ring; poll() never takes conn->lock. */
+	if (kdbus_pool_flags(conn->pool) & KDBUS_POOL_RING) {
+		if (kdbus_pool_ring_pending(conn->pool) > 0)
+			mask |= POLLIN | POLLRDNORM;
+	} else if (atomic_read(&conn->msg_count) > 0) {
 		mask |= POLLIN | POLLRDNORM;
-	mutex_unlock(&conn->lock);
+	}
+
+	/* all receivers which ran out of space for us have space again */
+	if (atomic_read(&conn->space_blocked) == 0)
+		mask |= POLLOUT | POLLWRNORM;
 
 	return mask;
 }
@@ -1520,6 +2962,22 @@ static int kdbus_conn_mmap(struct file *file, struct vm_area_struct *vma)
 	return kdbus_pool_mmap(conn->pool, vma);
 }
 
+static unsigned long kdbus_conn_get_unmapped_area(struct file *file,
+						  unsigned long addr,
+						  unsigned long len,
+						  unsigned long pgoff,
+						  unsigned long flags)
+{
+	struct kdbus_conn *conn = file->private_data;
+
+	if (conn->type != KDBUS_CONN_EP_CONNECTED)
+		return current->mm->get_unmapped_area(file, addr, len,
+						      pgoff, flags);
+
+	return kdbus_pool_get_unmapped_area(conn->pool, addr, len,
+					    pgoff, flags);
+}
+
 const struct file_operations kdbus_device_ops = {
 	.owner =		THIS_MODULE,
 	.open =			kdbus_conn_open,
@@ -1528,6 +2986,7 @@ const struct file_operations kdbus_device_ops = {
 	.llseek =		noop_llseek,
 	.unlocked_ioctl =	kdbus_conn_ioctl,
 	.mmap =			kdbus_conn_mmap,
+	.get_unmapped_area =	kdbus_conn_get_unmapped_area,
 #ifdef CONFIG_COMPAT
 	.compat_ioctl =		kdbus_conn_ioctl,
 #endif
@@ -13,6 +13,12 @@
 #ifndef __KDBUS_CONNECTION_H
 #define __KDBUS_CONNECTION_H
 
+#include <linux/hashtable.h>
+#include <linux/hrtimer.h>
+#include <linux/llist.h>
+#include <linux/rbtree.h>
+#include <linux/wait.h>
+
 #include "internal.h"
 #include "pool.h"
 
@@ -33,6 +39,7 @@ enum kdbus_conn_type {
 
 struct kdbus_conn {
 	struct kref kref;
+	struct rcu_head rcu;
 	enum kdbus_conn_type type;
 	struct kdbus_ns *ns;
 	union {
@@ -47,18 +54,30 @@ struct kdbus_conn {
 	struct mutex names_lock;
 	struct mutex accounting_lock;
 
-	struct list_head msg_list;
-	struct hlist_node hentry;
+	wait_queue_head_t wait;			/* new messages, for poll() */
+	struct llist_head msg_incoming;		/* sent, not yet linked */
+	struct list_head msg_list;		/* queued messages, in order */
+	struct list_head msg_prio_list[KDBUS_MSG_MAX_PRIORITY + 1];
+						/* queued messages by priority */
+	unsigned long msg_prio_mask;		/* non-empty priority levels */
 	struct list_head monitor_entry;		/* bus' monitor connections */
 	struct list_head names_list;		/* names on this connection */
 	struct list_head names_queue_list;
+	struct list_head calls;			/* waiting for their reply */
 
 	struct work_struct work;
-	struct timer_list timer;
+	struct hrtimer timer;
+	struct rb_root deadlines;		/* tracked messages by deadline */
+	DECLARE_HASHTABLE(reply_hash, 6);	/* calls waiting for a reply */
+	atomic_t reply_count;			/* own calls waiting for a reply */
 
 	struct kdbus_creds creds;
 	struct kdbus_match_db *match_db;
 
+	/* metadata of the last sending task, KDBUS_HELLO_ATTACH_* */
+	struct mutex meta_lock;
+	struct kdbus_meta_cache *meta_cache;
+
 #ifdef CONFIG_AUDITSYSCALL
 	u64 audit_ids[2];
 #endif
@@ -69,11 +88,25 @@ struct kdbus_conn {
 #endif
 
 	/* connection accounting */
-	unsigned int msg_count;
+	atomic_t msg_count;
+
+	/* flow control, senders waiting for space in our queue or pool */
+	atomic_t space_seq;			/* space freed, wakes senders */
+	struct list_head space_waiters;		/* senders out of space */
+	atomic_t space_blocked;			/* receivers we ran out of space at */
 	size_t allocated_size;
 
 	/* buffer to fill with message data */
 	struct kdbus_pool *pool;
+
+	/* registered submission ring */
+	struct mutex submit_lock;
+	struct kdbus_submit_ring __user *submit_ring;
+	u64 __user *submit_sq;
+	struct kdbus_submit_completion __user *submit_cq;
+	u64 submit_count;
+	u64 submit_sq_tail;
+	u64 submit_cq_head;
 };
 
 struct kdbus_kmsg;
@@ -83,8 +116,9 @@ int kdbus_conn_kmsg_send(struct kdbus_ep *ep,
 			 struct kdbus_conn *conn_src,
 			 struct kdbus_kmsg *kmsg);
 void kdbus_conn_queue_cleanup(struct kdbus_conn_queue *queue);
+bool kdbus_conn_tryref(struct kdbus_conn *conn);
 int kdbus_conn_queue_insert(struct kdbus_conn *conn, struct kdbus_kmsg *kmsg,
-			    u64 deadline_ns);
+			    u64 deadline_ns, bool expect_reply);
 
 int kdbus_conn_accounting_add_size(struct kdbus_conn *conn, size_t size);
 void kdbus_conn_accounting_sub_size(struct kdbus_conn *conn, size_t size);
@@ -187,8 +187,6 @@ int kdbus_ep_new(struct kdbus_bus *bus, const char *name, umode_t mode,
 		}
 	}
 
-	init_waitqueue_head(&e->wait);
-
 	mutex_unlock(&bus->ns->lock);
 
 	pr_debug("created endpoint %llu for bus '%s/%s/%s'\n",
@@ -18,7 +18,9 @@
 #define KDBUS_MSG_MAX_SIZE		SZ_8K		/* maximum size of message header and items */
 #define KDBUS_MSG_MAX_ITEMS		128		/* maximum number of message items */
 #define KDBUS_MSG_MAX_FDS		256		/* maximum number of passed file descriptors */
+#define KDBUS_MSG_MAX_PRIORITY		7		/* highest queue priority of a message */
 #define KDBUS_MSG_MAX_PAYLOAD_VEC_SIZE	SZ_8M		/* maximum message payload size */
+#define KDBUS_MSG_MAX_BATCH_SIZE	SZ_8K		/* maximum size of batch recv/release data */
 
 #define KDBUS_NAME_MAX_LEN		255		/* maximum length of well-known bus name */
 
@@ -31,6 +33,10 @@
 
 #define KDBUS_CONN_MAX_MSGS		64		/* maximum number of queued messages on the bus */
 #define KDBUS_CONN_MAX_ALLOCATED_BYTES	SZ_64K		/* maximum number of allocated bytes on the bus */
+#define KDBUS_CONN_MAX_SUBMIT		256		/* maximum number of entries of a submission ring */
+#define KDBUS_CONN_MAX_REQUESTS_PENDING	128		/* maximum number of calls waiting for a reply of a connection */
+#define KDBUS_CONN_BROADCAST_BATCH	16		/* receivers of a broadcast looked up at once */
+#define KDBUS_CONN_BROADCAST_SHARD	256		/* receivers of a broadcast delivered by one worker */
 
 #define KDBUS_CHAR_MAJOR		222		/* FIXME: move to uapi/linux/major.h */
 
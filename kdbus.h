@@ -98,6 +98,7 @@ enum {
 	KDBUS_MSG_BLOOM,		/* for broadcasts, carries bloom filter blob in .data */
 	KDBUS_MSG_DST_NAME,		/* destination's well-known name, in .str */
 	KDBUS_MSG_PRIORITY,		/* queue priority for message */
+	KDBUS_MSG_SEND_TIMEOUT,		/* block while the receiver is full, in .timeout_ns */
 
 	/* Filled in by kernelspace */
 	KDBUS_MSG_SRC_NAMES	= 0x400,/* NUL separated string list with well-known names of source */
@@ -140,6 +141,12 @@ struct kdbus_item {
 		/* connection */
 		__u64 id;
 
+		/* queue priority */
+		__u64 priority;
+
+		/* time to block for space in the receiver, 0 for no limit */
+		__u64 timeout_ns;
+
 		/* data vector */
 		struct kdbus_vec vec;
 
@@ -236,6 +243,9 @@ struct kdbus_cmd_policy {
 enum {
 	KDBUS_HELLO_STARTER		=  1 <<  0,
 	KDBUS_HELLO_ACCEPT_FD		=  1 <<  1,
+	KDBUS_HELLO_POOL_HUGEPAGE	=  1 <<  2,
+	KDBUS_HELLO_POOL_LOCKED		=  1 <<  3,
+	KDBUS_HELLO_POOL_RING		=  1 <<  4,
 
 	/* The following have an effect on directed messages only --
 	 * not for broadcasts */
@@ -272,11 +282,36 @@ struct kdbus_cmd_hello {
 	struct kdbus_item items[0];
 };
 
+/* Entry of the receive ring; the message carries file descriptors and
+ * needs to be received with KDBUS_CMD_MSG_RECV */
+#define KDBUS_POOL_RING_RECV		(1ULL << 63)
+
+/* The receive ring, at offset 0 of the pool of a connection created
+ * with KDBUS_HELLO_POOL_RING. Written by the kernel, read-only for the
+ * receiver. */
+struct kdbus_pool_ring {
+	__u64 head;		/* number of published messages */
+	__u64 released;		/* number of processed release entries */
+	__u64 count;		/* number of entries of both rings */
+	__u64 release_offset;	/* offset of the release ring */
+	__u64 entries[0];	/* pool offsets of messages */
+};
+
+/* The release ring, at .release_offset of the pool; it is the only part
+ * of the pool which can be mapped writable. Written by the receiver. */
+struct kdbus_pool_release_ring {
+	__u64 tail;		/* number of consumed receive entries */
+	__u64 head;		/* number of published release entries */
+	__u64 __pad[2];
+	__u64 entries[0];	/* pool offsets of messages to release */
+};
+
 /* Flags for kdbus_cmd_{bus,ep,ns}_make */
 enum {
 	KDBUS_MAKE_ACCESS_GROUP		= 1 <<  0,
 	KDBUS_MAKE_ACCESS_WORLD		= 1 <<  1,
 	KDBUS_MAKE_POLICY_OPEN		= 1 <<  2,
+	KDBUS_MAKE_BROADCAST_PARALLEL	= 1 <<  3,
 };
 
 /* Items to append to kdbus_cmd_{bus,ep,ns}_make */
@@ -390,6 +425,41 @@ struct kdbus_cmd_monitor {
 	__u32 __pad;
 };
 
+/* Offsets of messages for KDBUS_CMD_MSG_{RECV,RELEASE}_BATCH */
+struct kdbus_cmd_msg_batch {
+	__u64 size;		/* overall size, including the offsets array */
+	__u64 count;		/* number of used offsets; returned by RECV */
+	__u64 offsets[0];	/* pool offsets of messages */
+};
+
+/* Method call with KDBUS_CMD_MSG_CALL */
+struct kdbus_cmd_msg_call {
+	__u64 msg_address;	/* address of the struct kdbus_msg to send */
+	__u64 reply_offset;	/* returned pool offset of the reply */
+};
+
+/* Header of the submission ring in the sender's memory */
+struct kdbus_submit_ring {
+	__u64 sq_head;		/* userspace: number of submitted messages */
+	__u64 sq_tail;		/* kernel: number of processed messages */
+	__u64 cq_head;		/* kernel: number of posted completions */
+	__u64 cq_tail;		/* userspace: number of consumed completions */
+};
+
+/* Completion of a message from the submission ring */
+struct kdbus_submit_completion {
+	__u64 cookie;		/* cookie of the message */
+	__s64 ret;		/* 0 or negative error code of the send */
+};
+
+/* Register the submission ring with KDBUS_CMD_MSG_SUBMIT_RING */
+struct kdbus_cmd_submit_ring {
+	__u64 ring;		/* address of struct kdbus_submit_ring, or 0 */
+	__u64 sq;		/* address of the array of message addresses */
+	__u64 cq;		/* address of the array of completions */
+	__u64 count;		/* number of entries of both arrays */
+};
+
 /* FD states:
  * control nodes: unset
  *   bus owner  (via KDBUS_CMD_BUS_MAKE)
@@ -413,6 +483,11 @@ enum {
 	KDBUS_CMD_MSG_SEND =		_IOW(KDBUS_IOC_MAGIC, 0x40, struct kdbus_msg),
 	KDBUS_CMD_MSG_RECV =		_IOR(KDBUS_IOC_MAGIC, 0x41, __u64 *),
 	KDBUS_CMD_MSG_RELEASE =		_IOW(KDBUS_IOC_MAGIC, 0x42, __u64 *),
+	KDBUS_CMD_MSG_SUBMIT_RING =	_IOW(KDBUS_IOC_MAGIC, 0x43, struct kdbus_cmd_submit_ring),
+	KDBUS_CMD_MSG_SUBMIT =		_IO(KDBUS_IOC_MAGIC, 0x44),
+	KDBUS_CMD_MSG_RECV_BATCH =	_IOWR(KDBUS_IOC_MAGIC, 0x45, struct kdbus_cmd_msg_batch),
+	KDBUS_CMD_MSG_RELEASE_BATCH =	_IOW(KDBUS_IOC_MAGIC, 0x46, struct kdbus_cmd_msg_batch),
+	KDBUS_CMD_MSG_CALL =		_IOWR(KDBUS_IOC_MAGIC, 0x47, struct kdbus_cmd_msg_call),
 
 	KDBUS_CMD_NAME_ACQUIRE =	_IOWR(KDBUS_IOC_MAGIC, 0x50, struct kdbus_cmd_name),
 	KDBUS_CMD_NAME_RELEASE =	_IOW(KDBUS_IOC_MAGIC, 0x51, struct kdbus_cmd_name),
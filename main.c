@@ -24,6 +24,7 @@
 
 #include "internal.h"
 #include "namespace.h"
+#include "pool.h"
 
 /* kdbus sysfs subsystem */
 struct bus_type kdbus_subsys = {
@@ -45,25 +46,34 @@ static int __init kdbus_init(void)
 {
 	int ret;
 
-	ret = subsys_virtual_register(&kdbus_subsys, NULL);
+	ret = kdbus_pool_cache_init();
 	if (ret < 0)
 		return ret;
 
+	ret = subsys_virtual_register(&kdbus_subsys, NULL);
+	if (ret < 0)
+		goto exit_cache;
+
 	ret = kdbus_ns_new(NULL, NULL, 0666, &kdbus_ns_init);
 	if (ret < 0) {
 		bus_unregister(&kdbus_subsys);
 		pr_err("failed to initialize ret=%i\n", ret);
-		return ret;
+		goto exit_cache;
 	}
 
 	pr_info("initialized\n");
 	return 0;
+
+exit_cache:
+	kdbus_pool_cache_exit();
+	return ret;
 }
 
 static void __exit kdbus_exit(void)
 {
 	kdbus_ns_unref(kdbus_ns_init);
 	bus_unregister(&kdbus_subsys);
+	kdbus_pool_cache_exit();
 }
 
 module_init(kdbus_init);
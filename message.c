@@ -64,6 +64,18 @@ static void __maybe_unused kdbus_msg_dump(const struct kdbus_msg *msg)
 				item->memfd.fd);
 			break;
 
+		case KDBUS_MSG_PRIORITY:
+			pr_info("+KDBUS_MSG_PRIORITY (%zu bytes) priority=%llu\n",
+				(size_t)item->size,
+				(unsigned long long)item->priority);
+			break;
+
+		case KDBUS_MSG_SEND_TIMEOUT:
+			pr_info("+KDBUS_MSG_SEND_TIMEOUT (%zu bytes) timeout=%llu\n",
+				(size_t)item->size,
+				(unsigned long long)item->timeout_ns);
+			break;
+
 		default:
 			pr_info("+UNKNOWN type=%llu (%zu bytes)\n",
 				(unsigned long long)item->type,
@@ -73,12 +85,27 @@ static void __maybe_unused kdbus_msg_dump(const struct kdbus_msg *msg)
 	}
 }
 
-void kdbus_kmsg_free(struct kdbus_kmsg *kmsg)
+static void __kdbus_kmsg_free(struct kref *kref)
 {
+	struct kdbus_kmsg *kmsg = container_of(kref, struct kdbus_kmsg, kref);
+
 	kfree(kmsg->meta);
 	kfree(kmsg);
 }
 
+/* the workers of a parallel broadcast keep the message until they are
+ * done, even when the sender does not wait for them */
+struct kdbus_kmsg *kdbus_kmsg_ref(struct kdbus_kmsg *kmsg)
+{
+	kref_get(&kmsg->kref);
+	return kmsg;
+}
+
+void kdbus_kmsg_unref(struct kdbus_kmsg *kmsg)
+{
+	kref_put(&kmsg->kref, __kdbus_kmsg_free);
+}
+
 int kdbus_kmsg_new(size_t extra_size, struct kdbus_kmsg **m)
 {
 	size_t size;
@@ -89,6 +116,7 @@ int kdbus_kmsg_new(size_t extra_size, struct kdbus_kmsg **m)
 	if (!kmsg)
 		return -ENOMEM;
 
+	kref_init(&kmsg->kref);
 	kmsg->msg.size = size - KDBUS_KMSG_HEADER_SIZE;
 	kmsg->msg.items[0].size = KDBUS_ITEM_SIZE(extra_size);
 
@@ -105,6 +133,8 @@ static int kdbus_msg_scan_items(struct kdbus_conn *conn, struct kdbus_kmsg *kmsg
 	bool has_fds = false;
 	bool has_name = false;
 	bool has_bloom = false;
+	bool has_priority = false;
+	bool has_send_timeout = false;
 
 	KDBUS_PART_FOREACH(item, msg, items) {
 		if (!KDBUS_PART_VALID(item, msg))
@@ -213,6 +243,37 @@ static int kdbus_msg_scan_items(struct kdbus_conn *conn, struct kdbus_kmsg *kmsg
 			kmsg->dst_name = item->str;
 			break;
 
+		case KDBUS_MSG_PRIORITY:
+			if (item->size != KDBUS_PART_HEADER_SIZE + sizeof(__u64))
+				return -EINVAL;
+
+			/* do not allow multiple priorities */
+			if (has_priority)
+				return -EEXIST;
+			has_priority = true;
+
+			if (item->priority > KDBUS_MSG_MAX_PRIORITY)
+				return -EINVAL;
+
+			kmsg->priority = item->priority;
+			break;
+
+		case KDBUS_MSG_SEND_TIMEOUT:
+			if (item->size != KDBUS_PART_HEADER_SIZE + sizeof(__u64))
+				return -EINVAL;
+
+			if (has_send_timeout)
+				return -EEXIST;
+			has_send_timeout = true;
+
+			/* a broadcast does not wait for its receivers */
+			if (msg->dst_id == KDBUS_DST_ID_BROADCAST)
+				return -ENOTUNIQ;
+
+			kmsg->send_block = true;
+			kmsg->send_timeout_ns = item->timeout_ns;
+			break;
+
 		default:
 			return -ENOTSUPP;
 		}
@@ -270,6 +331,7 @@ int kdbus_kmsg_new_from_user(struct kdbus_conn *conn,
 	if (!kmsg)
 		return -ENOMEM;
 	memset(kmsg, 0, KDBUS_KMSG_HEADER_SIZE);
+	kref_init(&kmsg->kref);
 
 	if (copy_from_user(&kmsg->msg, msg, size)) {
 		ret = -EFAULT;
@@ -288,7 +350,7 @@ int kdbus_kmsg_new_from_user(struct kdbus_conn *conn,
 	return 0;
 
 exit_free:
-	kdbus_kmsg_free(kmsg);
+	kdbus_kmsg_unref(kmsg);
 	return ret;
 }
 
@@ -446,20 +508,40 @@ int kdbus_kmsg_append_cred(struct kdbus_kmsg *kmsg,
 	return 0;
 }
 
-int kdbus_kmsg_append_meta(struct kdbus_kmsg *kmsg,
-			   struct kdbus_conn *conn_src,
-			   struct kdbus_conn *conn_dst)
+/* we always return a 4 elements, the element size is 1/4  */
+struct kdbus_meta_caps {
+	u32 cap[4][_KERNEL_CAPABILITY_U32S];
+};
+
+static void kdbus_meta_caps_get(struct kdbus_meta_caps *caps)
 {
-	int ret = 0;
+	const struct cred *cred;
+	unsigned int i;
+
+	rcu_read_lock();
+	cred = __task_cred(current);
+	for (i = 0; i < _KERNEL_CAPABILITY_U32S; i++) {
+		caps->cap[0][i] = cred->cap_inheritable.cap[i];
+		caps->cap[1][i] = cred->cap_permitted.cap[i];
+		caps->cap[2][i] = cred->cap_effective.cap[i];
+		caps->cap[3][i] = cred->cap_bset.cap[i];
+	}
+	rcu_read_unlock();
 
-	if (!conn_src)
-		return 0;
+	/* clear unused bits */
+	for (i = 0; i < 4; i++)
+		caps->cap[i][CAP_TO_INDEX(CAP_LAST_CAP)] &=
+			CAP_TO_MASK(CAP_LAST_CAP + 1) - 1;
+}
 
-	/* all metadata already added */
-	if ((conn_dst->flags & kmsg->meta_attached) == conn_dst->flags)
-		return 0;
+/* collect the metadata of the current task for the given
+ * KDBUS_HELLO_ATTACH_* flags */
+static int kdbus_kmsg_collect_meta(struct kdbus_kmsg *kmsg,
+				   struct kdbus_conn *conn_src, u64 which)
+{
+	int ret = 0;
 
-	if (conn_dst->flags & KDBUS_HELLO_ATTACH_COMM) {
+	if (which & KDBUS_HELLO_ATTACH_COMM) {
 		char comm[TASK_COMM_LEN];
 
 		get_task_comm(comm, current->group_leader);
@@ -475,7 +557,7 @@ int kdbus_kmsg_append_meta(struct kdbus_kmsg *kmsg,
 		kmsg->meta_attached |= KDBUS_HELLO_ATTACH_COMM;
 	}
 
-	if (conn_dst->flags & KDBUS_HELLO_ATTACH_EXE) {
+	if (which & KDBUS_HELLO_ATTACH_EXE) {
 		struct mm_struct *mm = get_task_mm(current);
 		struct path *exe_path = NULL;
 
@@ -517,7 +599,7 @@ int kdbus_kmsg_append_meta(struct kdbus_kmsg *kmsg,
 		kmsg->meta_attached |= KDBUS_HELLO_ATTACH_EXE;
 	}
 
-	if (conn_dst->flags & KDBUS_HELLO_ATTACH_CMDLINE) {
+	if (which & KDBUS_HELLO_ATTACH_CMDLINE) {
 		struct mm_struct *mm = current->mm;
 		char *tmp;
 
@@ -545,31 +627,12 @@ int kdbus_kmsg_append_meta(struct kdbus_kmsg *kmsg,
 		kmsg->meta_attached |= KDBUS_HELLO_ATTACH_CMDLINE;
 	}
 
-	/* we always return a 4 elements, the element size is 1/4  */
-	if (conn_dst->flags & KDBUS_HELLO_ATTACH_CAPS) {
-		const struct cred *cred;
-		struct caps {
-			u32 cap[_KERNEL_CAPABILITY_U32S];
-		} cap[4];
-		unsigned int i;
-
-		rcu_read_lock();
-		cred = __task_cred(current);
-		for (i = 0; i < _KERNEL_CAPABILITY_U32S; i++) {
-			cap[0].cap[i] = cred->cap_inheritable.cap[i];
-			cap[1].cap[i] = cred->cap_permitted.cap[i];
-			cap[2].cap[i] = cred->cap_effective.cap[i];
-			cap[3].cap[i] = cred->cap_bset.cap[i];
-		}
-		rcu_read_unlock();
-
-		/* clear unused bits */
-		for (i = 0; i < 4; i++)
-			cap[i].cap[CAP_TO_INDEX(CAP_LAST_CAP)] &=
-				CAP_TO_MASK(CAP_LAST_CAP + 1) - 1;
+	if (which & KDBUS_HELLO_ATTACH_CAPS) {
+		struct kdbus_meta_caps caps;
 
+		kdbus_meta_caps_get(&caps);
 		ret = kdbus_kmsg_append_data(kmsg, KDBUS_MSG_SRC_CAPS,
-					     cap, sizeof(cap));
+					     &caps, sizeof(caps));
 		if (ret < 0)
 			return ret;
 
@@ -578,7 +641,7 @@ int kdbus_kmsg_append_meta(struct kdbus_kmsg *kmsg,
 
 #ifdef CONFIG_CGROUPS
 	/* attach the path of the one group hierarchy specified for the bus */
-	if (conn_dst->flags & KDBUS_HELLO_ATTACH_CGROUP) {
+	if (which & KDBUS_HELLO_ATTACH_CGROUP) {
 		char *tmp;
 
 		tmp = (char *) __get_free_page(GFP_TEMPORARY | __GFP_ZERO);
@@ -599,7 +662,7 @@ int kdbus_kmsg_append_meta(struct kdbus_kmsg *kmsg,
 #endif
 
 #ifdef CONFIG_AUDITSYSCALL
-	if (conn_dst->flags & KDBUS_HELLO_ATTACH_AUDIT) {
+	if (which & KDBUS_HELLO_ATTACH_AUDIT) {
 		ret = kdbus_kmsg_append_data(kmsg, KDBUS_MSG_SRC_AUDIT,
 					     conn_src->audit_ids,
 					     sizeof(conn_src->audit_ids));
@@ -611,7 +674,7 @@ int kdbus_kmsg_append_meta(struct kdbus_kmsg *kmsg,
 #endif
 
 #ifdef CONFIG_SECURITY
-	if (conn_dst->flags & KDBUS_HELLO_ATTACH_SECLABEL) {
+	if (which & KDBUS_HELLO_ATTACH_SECLABEL) {
 		if (conn_src->sec_label_len > 0) {
 			ret = kdbus_kmsg_append_data(kmsg,
 						     KDBUS_MSG_SRC_SECLABEL,
@@ -627,3 +690,229 @@ int kdbus_kmsg_append_meta(struct kdbus_kmsg *kmsg,
 
 	return 0;
 }
+
+/* the metadata a receiver can ask for */
+#define KDBUS_META_ATTACH_MASK				\
+	(KDBUS_HELLO_ATTACH_COMM |			\
+	 KDBUS_HELLO_ATTACH_EXE |			\
+	 KDBUS_HELLO_ATTACH_CMDLINE |			\
+	 KDBUS_HELLO_ATTACH_CGROUP |			\
+	 KDBUS_HELLO_ATTACH_CAPS |			\
+	 KDBUS_HELLO_ATTACH_SECLABEL |			\
+	 KDBUS_HELLO_ATTACH_AUDIT)
+
+/* A snapshot is not trusted for longer than this; the command line can
+ * be rewritten in place, and the addresses of the cgroup state compared
+ * below can be reused, without anything else of the task changing. */
+#define KDBUS_META_CACHE_MAX_AGE	HZ
+
+/* The properties of the sending task a snapshot of its metadata depends
+ * on. They are read without copying any data or taking a lock, and
+ * compared as a whole: the thread and the program it runs are
+ * identified by values which are not reused, the credentials by the
+ * struct cred, which is pinned by the snapshot and replaced by every
+ * change, the cgroups by the css_set, which is replaced when the task
+ * moves to another group. */
+struct kdbus_meta_key {
+	pid_t pid;			/* the sending thread */
+	struct timespec start_time;
+	u32 exec_id;			/* changes with every exec */
+	bool exe_changed;		/* PR_SET_MM_EXE_FILE, once per mm */
+	const struct cred *cred;
+	const void *css_set;
+	unsigned long arg_start;	/* PR_SET_MM_ARG_START */
+	unsigned long arg_end;
+	char comm[TASK_COMM_LEN];
+	char leader_comm[TASK_COMM_LEN];
+};
+
+/* The metadata of the last task which sent on a connection, collected
+ * once and copied into every message it sends. The snapshot is taken
+ * again when the key of the task differs, or it got too old. */
+struct kdbus_meta_cache {
+	u64 attached;			/* KDBUS_HELLO_ATTACH_* collected */
+	struct kdbus_item *meta;	/* the collected items */
+	size_t meta_size;
+
+	struct kdbus_meta_key key;
+	unsigned long expires;		/* in jiffies */
+};
+
+void kdbus_meta_cache_free(struct kdbus_meta_cache *cache)
+{
+	if (!cache)
+		return;
+
+	if (cache->key.cred)
+		put_cred(cache->key.cred);
+	kfree(cache->meta);
+	kfree(cache);
+}
+
+static void kdbus_meta_key_get(struct kdbus_meta_key *key)
+{
+	struct mm_struct *mm = current->mm;
+
+	/* the padding is compared as well */
+	memset(key, 0, sizeof(*key));
+
+	key->pid = task_pid_nr(current);
+	key->start_time = current->start_time;
+	key->exec_id = current->self_exec_id;
+	if (mm) {
+		key->exe_changed = test_bit(MMF_EXE_FILE_CHANGED,
+					    &mm->flags);
+		key->arg_start = mm->arg_start;
+		key->arg_end = mm->arg_end;
+	}
+
+	rcu_read_lock();
+	key->cred = __task_cred(current);
+#ifdef CONFIG_CGROUPS
+	key->css_set = task_css_set(current);
+#endif
+	rcu_read_unlock();
+
+	memcpy(key->comm, current->comm, TASK_COMM_LEN);
+	memcpy(key->leader_comm, current->group_leader->comm,
+	       TASK_COMM_LEN);
+}
+
+/* the KDBUS_HELLO_ATTACH_* flag a metadata item belongs to */
+static u64 kdbus_meta_item_flag(u64 type)
+{
+	switch (type) {
+	case KDBUS_MSG_SRC_PID_COMM:
+	case KDBUS_MSG_SRC_TID_COMM:
+		return KDBUS_HELLO_ATTACH_COMM;
+	case KDBUS_MSG_SRC_EXE:
+		return KDBUS_HELLO_ATTACH_EXE;
+	case KDBUS_MSG_SRC_CMDLINE:
+		return KDBUS_HELLO_ATTACH_CMDLINE;
+	case KDBUS_MSG_SRC_CGROUP:
+		return KDBUS_HELLO_ATTACH_CGROUP;
+	case KDBUS_MSG_SRC_CAPS:
+		return KDBUS_HELLO_ATTACH_CAPS;
+	case KDBUS_MSG_SRC_SECLABEL:
+		return KDBUS_HELLO_ATTACH_SECLABEL;
+	case KDBUS_MSG_SRC_AUDIT:
+		return KDBUS_HELLO_ATTACH_AUDIT;
+	}
+
+	return 0;
+}
+
+#define kdbus_meta_cache_foreach(item, cache)				\
+	for (item = (cache)->meta;					\
+	     (u8 *)item < (u8 *)(cache)->meta + (cache)->meta_size;	\
+	     item = KDBUS_PART_NEXT(item))
+
+/* Check if the snapshot still describes the current task; a change
+ * which races with the check shows up in the next message. */
+static bool kdbus_meta_cache_valid(const struct kdbus_meta_cache *cache)
+{
+	struct kdbus_meta_key key;
+
+	if (time_after_eq(jiffies, cache->expires))
+		return false;
+
+	kdbus_meta_key_get(&key);
+	return memcmp(&cache->key, &key, sizeof(key)) == 0;
+}
+
+/* take a snapshot of the metadata of the current task; the properties
+ * to compare to are recorded before the metadata is collected */
+static int kdbus_meta_cache_new(struct kdbus_conn *conn_src, u64 which,
+				struct kdbus_meta_cache **c)
+{
+	struct kdbus_meta_cache *cache;
+	struct kdbus_kmsg *kmsg;
+	int ret;
+
+	cache = kzalloc(sizeof(struct kdbus_meta_cache), GFP_KERNEL);
+	if (!cache)
+		return -ENOMEM;
+
+	kmsg = kzalloc(sizeof(struct kdbus_kmsg), GFP_KERNEL);
+	if (!kmsg) {
+		kfree(cache);
+		return -ENOMEM;
+	}
+	kref_init(&kmsg->kref);
+
+	kdbus_meta_key_get(&cache->key);
+	get_cred(cache->key.cred);
+	cache->expires = jiffies + KDBUS_META_CACHE_MAX_AGE;
+
+	ret = kdbus_kmsg_collect_meta(kmsg, conn_src, which);
+	if (ret < 0) {
+		kdbus_kmsg_unref(kmsg);
+		kdbus_meta_cache_free(cache);
+		return ret;
+	}
+
+	/* flags without any data, or not built in, are attached as well */
+	cache->attached = which;
+	cache->meta = kmsg->meta;
+	cache->meta_size = kmsg->meta_size;
+	kmsg->meta = NULL;
+	kdbus_kmsg_unref(kmsg);
+
+	*c = cache;
+	return 0;
+}
+
+/* Add the metadata the receiver asks for and the message does not carry
+ * yet. The items are copied from the snapshot of the sender, which is
+ * only collected again when it is outdated, or lacks items. */
+int kdbus_kmsg_append_meta(struct kdbus_kmsg *kmsg,
+			   struct kdbus_conn *conn_src,
+			   struct kdbus_conn *conn_dst)
+{
+	struct kdbus_meta_cache *cache;
+	const struct kdbus_item *item;
+	u64 want;
+	int ret = 0;
+
+	if (!conn_src)
+		return 0;
+
+	/* all metadata already added */
+	want = conn_dst->flags & KDBUS_META_ATTACH_MASK & ~kmsg->meta_attached;
+	if (want == 0)
+		return 0;
+
+	mutex_lock(&conn_src->meta_lock);
+	cache = conn_src->meta_cache;
+	if (!cache || (want & ~cache->attached) ||
+	    !kdbus_meta_cache_valid(cache)) {
+		u64 which = want;
+
+		/* keep what other receivers asked for */
+		if (cache)
+			which |= cache->attached;
+
+		ret = kdbus_meta_cache_new(conn_src, which, &cache);
+		if (ret < 0)
+			goto exit_unlock;
+
+		kdbus_meta_cache_free(conn_src->meta_cache);
+		conn_src->meta_cache = cache;
+	}
+
+	kdbus_meta_cache_foreach(item, cache) {
+		if (!(kdbus_meta_item_flag(item->type) & want))
+			continue;
+
+		ret = kdbus_kmsg_append_data(kmsg, item->type, item->data,
+					     item->size - KDBUS_PART_HEADER_SIZE);
+		if (ret < 0)
+			goto exit_unlock;
+	}
+
+	kmsg->meta_attached |= want;
+
+exit_unlock:
+	mutex_unlock(&conn_src->meta_lock);
+	return ret;
+}
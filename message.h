@@ -12,9 +12,16 @@
 #ifndef __KDBUS_MESSAGE_H
 #define __KDBUS_MESSAGE_H
 
+#include <linux/kref.h>
+
 #include "internal.h"
 
+struct kdbus_conn_call;
+struct kdbus_meta_cache;
+
 struct kdbus_kmsg {
+	struct kref kref;
+
 	/* short-cuts for faster lookup */
 	u64 notification_type;
 	const char *dst_name;
@@ -35,6 +42,20 @@ struct kdbus_kmsg {
 	unsigned int vecs_count;
 	unsigned int memfds_count;
 
+	/* queue priority, KDBUS_MSG_PRIORITY */
+	unsigned int priority;
+
+	/* the sender blocks for the reply, KDBUS_CMD_MSG_CALL */
+	struct kdbus_conn_call *call;
+
+	/* a KDBUS_CMD_MSG_CALL, or the reply to it, wakes up in sync */
+	bool sync;
+
+	/* the sender blocks while the receiver is full,
+	 * KDBUS_MSG_SEND_TIMEOUT */
+	bool send_block;
+	u64 send_timeout_ns;
+
 	/* added metadata flags KDBUS_HELLO_ATTACH_* */
 	u64 meta_attached;
 
@@ -46,13 +67,15 @@ struct kdbus_conn;
 
 int kdbus_kmsg_new(size_t extra_size, struct kdbus_kmsg **m);
 int kdbus_kmsg_new_from_user(struct kdbus_conn *conn, struct kdbus_msg __user *msg, struct kdbus_kmsg **m);
-void kdbus_kmsg_free(struct kdbus_kmsg *kmsg);
+struct kdbus_kmsg *kdbus_kmsg_ref(struct kdbus_kmsg *kmsg);
+void kdbus_kmsg_unref(struct kdbus_kmsg *kmsg);
 
 int kdbus_kmsg_append_timestamp(struct kdbus_kmsg *kmsg, u64 *now_ns);
 int kdbus_kmsg_append_src_names(struct kdbus_kmsg *kmsg,
 				struct kdbus_conn *conn);
 int kdbus_kmsg_append_cred(struct kdbus_kmsg *kmsg,
 			   const struct kdbus_creds *creds);
+void kdbus_meta_cache_free(struct kdbus_meta_cache *cache);
 int kdbus_kmsg_append_meta(struct kdbus_kmsg *kmsg,
 			   struct kdbus_conn *conn_src,
 			   struct kdbus_conn *conn_dst);
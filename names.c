@@ -184,17 +184,24 @@ void kdbus_name_remove_by_conn(struct kdbus_name_registry *reg,
 	mutex_unlock(&reg->entries_lock);
 }
 
-struct kdbus_name_entry *kdbus_name_lookup(struct kdbus_name_registry *reg,
-					   const char *name)
+/* Look up the owner of a name and pin it. The entry, and the owner
+ * with it, can go away as soon as entries_lock is dropped; the owner is
+ * pinned before that. Returns NULL if the name is not owned, or the
+ * owner is going away. */
+struct kdbus_conn *kdbus_name_lookup_conn(struct kdbus_name_registry *reg,
+					  const char *name)
 {
-	struct kdbus_name_entry *e = NULL;
+	struct kdbus_name_entry *e;
+	struct kdbus_conn *conn = NULL;
 	u32 hash = kdbus_str_hash(name);
 
 	mutex_lock(&reg->entries_lock);
 	e = __kdbus_name_lookup(reg, hash, name);
+	if (e && kdbus_conn_tryref(e->conn))
+		conn = e->conn;
 	mutex_unlock(&reg->entries_lock);
 
-	return e;
+	return conn;
 }
 
 static int kdbus_name_queue_conn(struct kdbus_conn *conn, u64 *flags,
@@ -31,13 +31,17 @@
 static int kdbus_notify_reply(struct kdbus_ep *ep, u64 src_id,
 			      u64 cookie, u64 msg_type)
 {
-	struct kdbus_conn *dst_conn;
 	struct kdbus_kmsg *kmsg;
 	struct kdbus_item *item;
+	bool found;
 	int ret;
 
-	dst_conn = kdbus_bus_find_conn_by_id(ep->bus, src_id);
-	if (!dst_conn)
+	/* do not build a notification for a sender which is gone; the
+	 * connection is only checked, the send looks it up again */
+	rcu_read_lock();
+	found = kdbus_bus_find_conn_by_id(ep->bus, src_id) != NULL;
+	rcu_read_unlock();
+	if (!found)
 		return -ENXIO;
 
 	ret = kdbus_kmsg_new(KDBUS_ITEM_SIZE(0), &kmsg);
@@ -60,7 +64,7 @@ static int kdbus_notify_reply(struct kdbus_ep *ep, u64 src_id,
 	item->type = msg_type;
 
 	ret = kdbus_conn_kmsg_send(ep, NULL, kmsg);
-	kdbus_kmsg_free(kmsg);
+	kdbus_kmsg_unref(kmsg);
 
 	return ret;
 }
@@ -108,7 +112,7 @@ int kdbus_notify_name_change(struct kdbus_ep *ep, u64 type,
 	strcpy(name_change->name, name);
 
 	ret = kdbus_conn_kmsg_send(ep, NULL, kmsg);
-	kdbus_kmsg_free(kmsg);
+	kdbus_kmsg_unref(kmsg);
 
 	return ret;
 }
@@ -140,7 +144,7 @@ int kdbus_notify_id_change(struct kdbus_ep *ep, u64 type,
 	id_change->flags = flags;
 
 	ret = kdbus_conn_kmsg_send(ep, NULL, kmsg);
-	kdbus_kmsg_free(kmsg);
+	kdbus_kmsg_unref(kmsg);
 
 	return ret;
 }
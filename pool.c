@@ -20,14 +20,57 @@
 #include <linux/init.h>
 #include <linux/mm.h>
 #include <linux/highmem.h>
-#include <linux/rbtree.h>
+#include <linux/hashtable.h>
+#include <linux/bitops.h>
+#include <linux/log2.h>
 #include <linux/file.h>
 #include <linux/shmem_fs.h>
 #include <linux/aio.h>
+#include <linux/uio.h>
+#include <linux/pagemap.h>
+#include <linux/swap.h>
+#include <linux/falloc.h>
+#include <linux/huge_mm.h>
+#include <linux/mman.h>
+#include <linux/capability.h>
+#include <linux/mutex.h>
 
 #include "pool.h"
 #include "message.h"
 
+/* allocation unit of the pool; all slices are a multiple of it */
+#define KDBUS_POOL_GRANULE	8
+
+/* number of power-of-two size classes of free slices */
+#define KDBUS_POOL_CLASSES	BITS_PER_LONG
+
+/* The busy map has about one bucket for every slice of this size in
+ * the active part of the pool; it grows along with the pool. */
+#define KDBUS_POOL_BUSY_SLICE		SZ_1K
+#define KDBUS_POOL_BUSY_BITS_MIN	6
+#define KDBUS_POOL_BUSY_BITS_MAX	12
+
+/* number of free slices looked at in the class of the requested size,
+ * when the pool is exhausted */
+#define KDBUS_POOL_WALK_MAX	16
+
+/* number of unused slice structures kept around by every pool */
+#define KDBUS_POOL_SPARE_SLICES	16
+
+/* initially used part of the pool, it grows on demand up to the
+ * size requested at HELLO */
+#define KDBUS_POOL_ACTIVE_MIN	SZ_64K
+
+/* minimum size of a free slice to give its pages back to the system */
+#define KDBUS_POOL_PUNCH_MIN	SZ_64K
+
+/* the pages below this offset are never given back; the messages in
+ * flight are mostly allocated at the start of the pool, and would have
+ * their pages released and faulted in again with every message */
+#define KDBUS_POOL_RESIDENT_MIN	SZ_1M
+
+static struct kmem_cache *kdbus_slice_cache;
+
 /*
  * Messages sent with KDBUS_CMD_MSG_SEND are copied direcly by the
  * sending process into the receiver's pool.
@@ -42,30 +85,58 @@
 /* The receiver's buffer, managed as a pool of allocated and free
  * slices containing the queued messages. */
 struct kdbus_pool {
+	struct mutex lock;		/* slices and rings */
 	struct file *f;			/* shmem file */
 	size_t size;			/* size of file  */
+	size_t active;			/* size covered by slices */
 	size_t busy;			/* currently allocated size */
+	size_t page_size;		/* unit to grow and release pages */
+	unsigned int flags;		/* KDBUS_POOL_* */
+
+	/* receive and release rings in the first two pages */
+	size_t reserved;		/* size reserved for the rings */
+	struct page *ring_pages[2];	/* receive ring, release ring */
+	u64 ring_count;			/* number of entries of a ring */
+	u64 ring_head;			/* published receive entries */
+	u64 ring_tail;			/* consumed receive entries */
+	u64 ring_released;		/* processed release entries */
 
 	struct list_head slices;	/* all slices sorted by address */
-	struct rb_root slices_busy;	/* tree of allocated slices */
-	struct rb_root slices_free;	/* tree of free slices */
+	struct list_head slices_free[KDBUS_POOL_CLASSES];
+					/* free slices by size class */
+	unsigned long slices_free_mask;	/* non-empty size classes */
+	struct hlist_head *slices_busy;	/* allocated slices by offset */
+	unsigned int slices_busy_bits;	/* size of the busy map */
+
+	struct list_head slices_spare;	/* unused slice structures */
+	unsigned int slices_spare_count;
 };
 
-/* The pool has one or more slices, always spanning the entire size of the
- * pool.
+/* The pool has one or more slices, always spanning the active part of
+ * the pool. The active part starts small and is doubled whenever an
+ * allocation does not fit, up to the entire size of the pool; pages
+ * are only allocated when they are written to. Large free slices give
+ * their pages back to the system.
  *
  * Every slice is an element in a list sorted by the buffer address, to
  * provide access to the next neighbor slice.
  *
- * Every slice is member in either the busy or the free tree. The free
- * tree is organized by slice size, the busy tree organized by buffer
- * offset. */
+ * Every free slice is member of the free list of its size class; the
+ * class of a slice is the power-of-two order of its size in granules.
+ * Every allocated slice is member of the busy map, hashed by its buffer
+ * offset; the map is resized when the active part of the pool grows.
+ * Allocation, release and merging with the neighbors are all constant
+ * time operations; an allocation takes the first slice of the smallest
+ * size class which is guaranteed to fit, and grows the pool if there is
+ * none. Only when the pool cannot grow anymore, a bounded number of the
+ * slices of the class of the requested size are tried. */
 struct kdbus_slice {
 	size_t off;			/* offset of slice */
 	size_t size;			/* size of slice */
 
 	struct list_head entry;
-	struct rb_node rb_node;
+	struct list_head free_entry;
+	struct hlist_node hentry;
 	bool free;
 };
 
@@ -74,8 +145,8 @@ static void __maybe_unused kdbus_pool_slices_dump(struct kdbus_pool *pool,
 {
 	struct kdbus_slice *s;
 
-	pr_info("=== dump start '%s' pool=%p size=%zu ===\n",
-		str, pool, pool->size);
+	pr_info("=== dump start '%s' pool=%p size=%zu active=%zu ===\n",
+		str, pool, pool->size, pool->active);
 
 	list_for_each_entry(s, &pool->slices, entry)
 		pr_info("  slice=%p free=%u, off=%zu size=%zu\n",
@@ -84,134 +155,274 @@ static void __maybe_unused kdbus_pool_slices_dump(struct kdbus_pool *pool,
 	pr_info("=== dump end '%s' pool=%p ===\n", str, pool);
 }
 
-static struct kdbus_slice *kdbus_pool_slice_new(size_t off, size_t size)
+/* get a new slice; prefer the spare slices of the pool, only go to the
+ * slab cache if there are none left */
+static struct kdbus_slice *kdbus_pool_slice_new(struct kdbus_pool *pool,
+						size_t off, size_t size)
 {
 	struct kdbus_slice *slice;
 
-	slice = kzalloc(sizeof(struct kdbus_slice), GFP_KERNEL);
-	if (!slice)
-		return NULL;
+	if (!list_empty(&pool->slices_spare)) {
+		slice = list_first_entry(&pool->slices_spare,
+					 struct kdbus_slice, entry);
+		list_del(&slice->entry);
+		pool->slices_spare_count--;
+	} else {
+		slice = kmem_cache_alloc(kdbus_slice_cache, GFP_KERNEL);
+		if (!slice)
+			return NULL;
+	}
 
+	memset(slice, 0, sizeof(struct kdbus_slice));
 	slice->off = off;
 	slice->size = size;
 	slice->free = true;
 	return slice;
 }
 
-/* insert a slice into the free tree */
+/* put a no longer needed slice back to the spare slices of the pool */
+static void kdbus_pool_slice_free(struct kdbus_pool *pool,
+				  struct kdbus_slice *slice)
+{
+	if (pool->slices_spare_count >= KDBUS_POOL_SPARE_SLICES) {
+		kmem_cache_free(kdbus_slice_cache, slice);
+		return;
+	}
+
+	list_add(&slice->entry, &pool->slices_spare);
+	pool->slices_spare_count++;
+}
+
+/* size class of a free slice; slices in class n have a size
+ * of [2^n, 2^(n+1)) granules */
+static unsigned int kdbus_pool_slice_class(size_t size)
+{
+	return __fls(size / KDBUS_POOL_GRANULE);
+}
+
+/* add a slice to the free list of its size class */
 static void kdbus_pool_add_free_slice(struct kdbus_pool *pool,
 				      struct kdbus_slice *slice)
 {
-	struct rb_node **n;
-	struct rb_node *pn = NULL;
+	unsigned int class = kdbus_pool_slice_class(slice->size);
 
-	n = &pool->slices_free.rb_node;
-	while (*n) {
-		struct kdbus_slice *pslice;
+	list_add(&slice->free_entry, &pool->slices_free[class]);
+	__set_bit(class, &pool->slices_free_mask);
+}
 
-		pn = *n;
-		pslice = rb_entry(pn, struct kdbus_slice, rb_node);
-		if (slice->size < pslice->size)
-			n = &pn->rb_left;
-		else
-			n = &pn->rb_right;
-	}
+/* remove a slice from the free list of its size class */
+static void kdbus_pool_remove_free_slice(struct kdbus_pool *pool,
+					 struct kdbus_slice *slice)
+{
+	unsigned int class = kdbus_pool_slice_class(slice->size);
 
-	rb_link_node(&slice->rb_node, pn, n);
-	rb_insert_color(&slice->rb_node, &pool->slices_free);
+	list_del(&slice->free_entry);
+	if (list_empty(&pool->slices_free[class]))
+		__clear_bit(class, &pool->slices_free_mask);
 }
 
-/* insert a slice into the busy tree */
-static void kdbus_pool_add_busy_slice(struct kdbus_pool *pool,
-				      struct kdbus_slice *slice)
+/* number of bits of the busy map for the given active size */
+static unsigned int kdbus_pool_busy_bits(size_t active)
+{
+	unsigned int bits;
+
+	bits = ilog2(max_t(size_t, active / KDBUS_POOL_BUSY_SLICE, 1));
+	return clamp_t(unsigned int, bits,
+		       KDBUS_POOL_BUSY_BITS_MIN, KDBUS_POOL_BUSY_BITS_MAX);
+}
+
+static struct hlist_head *kdbus_pool_busy_new(unsigned int bits)
+{
+	struct hlist_head *busy;
+	unsigned int i;
+
+	busy = kmalloc(sizeof(struct hlist_head) << bits, GFP_KERNEL);
+	if (!busy)
+		return NULL;
+
+	for (i = 0; i < 1U << bits; i++)
+		INIT_HLIST_HEAD(&busy[i]);
+
+	return busy;
+}
+
+/* the bucket of the busy map for the given pool offset */
+static struct hlist_head *kdbus_pool_busy_head(struct kdbus_pool *pool,
+					       size_t off)
+{
+	return &pool->slices_busy[hash_min(off, pool->slices_busy_bits)];
+}
+
+/* Re-hash the allocated slices into a larger busy map, when the active
+ * part of the pool has grown. The pool only grows by doubling its size,
+ * the cost of the re-hash is spread over the allocations. If there is
+ * no memory for a larger map, the current one is kept. */
+static void kdbus_pool_busy_resize(struct kdbus_pool *pool)
 {
-	struct rb_node **n;
-	struct rb_node *pn = NULL;
+	unsigned int bits = kdbus_pool_busy_bits(pool->active);
+	unsigned int old_bits = pool->slices_busy_bits;
+	struct hlist_head *old = pool->slices_busy;
+	struct hlist_head *busy;
+	struct kdbus_slice *s;
+	struct hlist_node *tmp;
+	unsigned int i;
+
+	if (bits <= old_bits)
+		return;
+
+	busy = kdbus_pool_busy_new(bits);
+	if (!busy)
+		return;
 
-	n = &pool->slices_busy.rb_node;
-	while (*n) {
-		struct kdbus_slice *pslice;
+	pool->slices_busy = busy;
+	pool->slices_busy_bits = bits;
 
-		pn = *n;
-		pslice = rb_entry(pn, struct kdbus_slice, rb_node);
-		if (slice->off < pslice->off)
-			n = &pn->rb_left;
-		else if (slice->off > pslice->off)
-			n = &pn->rb_right;
+	for (i = 0; i < 1U << old_bits; i++) {
+		hlist_for_each_entry_safe(s, tmp, &old[i], hentry) {
+			hlist_del(&s->hentry);
+			hlist_add_head(&s->hentry,
+				       kdbus_pool_busy_head(pool, s->off));
+		}
 	}
 
-	rb_link_node(&slice->rb_node, pn, n);
-	rb_insert_color(&slice->rb_node, &pool->slices_busy);
+	kfree(old);
 }
 
 /* find a slice by its pool offset */
 static struct kdbus_slice *kdbus_pool_find_slice(struct kdbus_pool *pool,
 						 size_t off)
 {
-	struct rb_node *n;
+	struct kdbus_slice *s;
 
-	n = pool->slices_busy.rb_node;
-	while (n) {
-		struct kdbus_slice *s;
+	hlist_for_each_entry(s, kdbus_pool_busy_head(pool, off), hentry)
+		if (s->off == off)
+			return s;
+
+	return NULL;
+}
+
+/* find a free slice which is at least of the given size */
+static struct kdbus_slice *kdbus_pool_find_free_slice(struct kdbus_pool *pool,
+						      size_t size)
+{
+	size_t granules = size / KDBUS_POOL_GRANULE;
+	unsigned int class = __fls(granules);
+	unsigned long mask;
+
+	/* Every slice in the class of a power-of-two size is large enough,
+	 * the request is rounded up to the next class otherwise. */
+	if (!is_power_of_2(granules))
+		class++;
+
+	if (class >= KDBUS_POOL_CLASSES)
+		return NULL;
+
+	/* pick the first slice of the smallest class that fits */
+	mask = pool->slices_free_mask & (~0UL << class);
+	if (!mask)
+		return NULL;
+
+	return list_first_entry(&pool->slices_free[__ffs(mask)],
+				struct kdbus_slice, free_entry);
+}
+
+/* The pool cannot grow anymore; look for a slice in the class of the
+ * requested size which is large enough. Only a bounded number of
+ * slices is tried, the allocation fails if none of them fits. */
+static struct kdbus_slice *kdbus_pool_walk_free_slice(struct kdbus_pool *pool,
+						      size_t size)
+{
+	unsigned int class = kdbus_pool_slice_class(size);
+	unsigned int n = 0;
+	struct kdbus_slice *s;
 
-		s = rb_entry(n, struct kdbus_slice, rb_node);
-		if (off < s->off)
-			n = n->rb_left;
-		else if (off > s->off)
-			n = n->rb_right;
-		else
+	list_for_each_entry(s, &pool->slices_free[class], free_entry) {
+		if (s->size >= size)
 			return s;
+
+		if (++n == KDBUS_POOL_WALK_MAX)
+			break;
 	}
 
 	return NULL;
 }
 
+/* extend the active part of the pool to make room for the given size */
+static int kdbus_pool_grow(struct kdbus_pool *pool, size_t size)
+{
+	struct kdbus_slice *last;
+	size_t active;
+
+	if (pool->active == pool->size)
+		return -ENOBUFS;
+
+	active = max(pool->active * 2,
+		     ALIGN(pool->active + size, pool->page_size));
+	active = min(active, pool->size);
+
+	/* extend the last slice if it is free, add a new one otherwise */
+	last = list_entry(pool->slices.prev, struct kdbus_slice, entry);
+	if (last->free) {
+		kdbus_pool_remove_free_slice(pool, last);
+		last->size += active - pool->active;
+		kdbus_pool_add_free_slice(pool, last);
+	} else {
+		struct kdbus_slice *s;
+
+		s = kdbus_pool_slice_new(pool, pool->active,
+					 active - pool->active);
+		if (!s)
+			return -ENOMEM;
+
+		list_add_tail(&s->entry, &pool->slices);
+		kdbus_pool_add_free_slice(pool, s);
+	}
+
+	pool->active = active;
+	kdbus_pool_busy_resize(pool);
+	return 0;
+}
+
 /* allocate a slice from the pool with the given size */
 static int kdbus_pool_alloc_slice(struct kdbus_pool *pool,
 				  size_t size, struct kdbus_slice **slice)
 {
 	size_t slice_size = KDBUS_ALIGN8(size);
-	struct rb_node *n;
+	struct kdbus_slice *s_new = NULL;
 	struct kdbus_slice *s;
-	struct rb_node *found = NULL;
-
-	/* search a free slice with the closest matching size */
-	n = pool->slices_free.rb_node;
-	while (n) {
-		s = rb_entry(n, struct kdbus_slice, rb_node);
-		if (slice_size < s->size) {
-			found = n;
-			n = n->rb_left;
-		} else if (slice_size > s->size)
-			n = n->rb_right;
-		else {
-			found = n;
-			break;
-		}
-	}
-
-	/* no slice with the minimum size found in the pool */
-	if (!found)
-		return -ENOBUFS;
+	int ret;
 
-	/* no exact match, use the closest one */
-	if (!n)
-		s = rb_entry(found, struct kdbus_slice, rb_node);
+	if (slice_size == 0)
+		return -EINVAL;
 
-	/* move slice from free to the busy tree */
-	rb_erase(found, &pool->slices_free);
-	kdbus_pool_add_busy_slice(pool, s);
+	/* grow the pool until the slice fits, or the pool is exhausted */
+	for (;;) {
+		s = kdbus_pool_find_free_slice(pool, slice_size);
+		if (s)
+			break;
 
-	/* we got a slice larger than what we asked for? */
-	if (s->size > slice_size) {
-		struct kdbus_slice *s_new;
+		ret = kdbus_pool_grow(pool, slice_size);
+		if (ret == -ENOBUFS)
+			s = kdbus_pool_walk_free_slice(pool, slice_size);
+		if (s)
+			break;
+		if (ret < 0)
+			return ret;
+	}
 
-		/* split-off the remainder of the size to its own slice */
-		s_new = kdbus_pool_slice_new(s->off + slice_size,
+	/* We got a slice larger than what we asked for; get the slice
+	 * to split-off the remainder before we touch anything. If that
+	 * fails, hand out the entire slice, it will be merged back into
+	 * the pool as a whole when it is released. */
+	if (s->size > slice_size)
+		s_new = kdbus_pool_slice_new(pool, s->off + slice_size,
 					     s->size - slice_size);
-		if (!s_new)
-			return -ENOMEM;
 
+	/* move slice from the free lists to the busy map */
+	kdbus_pool_remove_free_slice(pool, s);
+	hlist_add_head(&s->hentry, kdbus_pool_busy_head(pool, s->off));
+
+	if (s_new) {
 		list_add(&s_new->entry, &s->entry);
 		kdbus_pool_add_free_slice(pool, s_new);
 
@@ -225,11 +436,47 @@ static int kdbus_pool_alloc_slice(struct kdbus_pool *pool,
 	return 0;
 }
 
+/* Give the pages of a released range back to the system, if it ended
+ * up in a large free slice. Only the pages which were touched by the
+ * range and are entirely covered by the free slice are released; pages
+ * of smaller free slices, and the pages at the start of the pool, stay
+ * around, they will likely be used again soon. */
+static void kdbus_pool_punch_slice(struct kdbus_pool *pool,
+				   const struct kdbus_slice *slice,
+				   size_t off, size_t end)
+{
+	size_t page = pool->page_size;
+	size_t start, stop;
+
+	/* a locked pool keeps all its pages */
+	if (pool->flags & KDBUS_POOL_LOCKED)
+		return;
+
+	if (slice->size < max_t(size_t, KDBUS_POOL_PUNCH_MIN, page))
+		return;
+
+	start = max(round_down(off, page), ALIGN(slice->off, page));
+	start = max_t(size_t, start, ALIGN(KDBUS_POOL_RESIDENT_MIN, page));
+	stop = min(ALIGN(end, page),
+		   round_down(slice->off + slice->size, page));
+	if (start >= stop)
+		return;
+
+	/* the pages are re-allocated on the next write, failing to
+	 * release them is not an error */
+	pool->f->f_op->fallocate(pool->f,
+				 FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				 start, stop - start);
+}
+
 /* return an allocated slice back to the pool */
 static void kdbus_pool_free_slice(struct kdbus_pool *pool,
 				  struct kdbus_slice *slice)
 {
-	rb_erase(&slice->rb_node, &pool->slices_busy);
+	size_t off = slice->off;
+	size_t end = slice->off + slice->size;
+
+	hash_del(&slice->hentry);
 	pool->busy -= slice->size;
 
 	/* merge with the next free slice */
@@ -238,10 +485,10 @@ static void kdbus_pool_free_slice(struct kdbus_pool *pool,
 
 		s = list_entry(slice->entry.next, struct kdbus_slice, entry);
 		if (s->free) {
-			rb_erase(&s->rb_node, &pool->slices_free);
+			kdbus_pool_remove_free_slice(pool, s);
 			list_del(&s->entry);
 			slice->size += s->size;
-			kfree(s);
+			kdbus_pool_slice_free(pool, s);
 		}
 	}
 
@@ -251,23 +498,105 @@ static void kdbus_pool_free_slice(struct kdbus_pool *pool,
 
 		s = list_entry(slice->entry.prev, struct kdbus_slice, entry);
 		if (s->free) {
-			rb_erase(&s->rb_node, &pool->slices_free);
+			kdbus_pool_remove_free_slice(pool, s);
 			list_del(&slice->entry);
 			s->size += slice->size;
-			kfree(slice);
+			kdbus_pool_slice_free(pool, slice);
 			slice = s;
 		}
 	}
 
 	slice->free = true;
 	kdbus_pool_add_free_slice(pool, slice);
+
+	kdbus_pool_punch_slice(pool, slice, off, end);
+}
+
+int kdbus_pool_cache_init(void)
+{
+	kdbus_slice_cache = KMEM_CACHE(kdbus_slice, 0);
+	if (!kdbus_slice_cache)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void kdbus_pool_cache_exit(void)
+{
+	kmem_cache_destroy(kdbus_slice_cache);
+}
+
+/* The mappings of a locked pool are locked, and charged to the
+ * RLIMIT_MEMLOCK of the mapping process by mmap(). A pool which can
+ * never be mapped within the limit is refused right away. */
+static int kdbus_pool_lock_check(size_t size)
+{
+	if (capable(CAP_IPC_LOCK))
+		return 0;
+
+	if (size > rlimit(RLIMIT_MEMLOCK))
+		return -ENOMEM;
+
+	return 0;
+}
+
+static void kdbus_pool_ring_exit(struct kdbus_pool *pool)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(pool->ring_pages); i++) {
+		if (!pool->ring_pages[i])
+			continue;
+
+		page_cache_release(pool->ring_pages[i]);
+		pool->ring_pages[i] = NULL;
+	}
+}
+
+/* Reserve the first two pages of the pool for the receive and the
+ * release ring. The pages stay referenced for the lifetime of the
+ * pool, they are accessed with every queued message. */
+static int kdbus_pool_ring_init(struct kdbus_pool *pool)
+{
+	struct kdbus_pool_ring *ring;
+	unsigned int i;
+
+	if (pool->size <= 2 * PAGE_SIZE)
+		return -EINVAL;
+
+	for (i = 0; i < ARRAY_SIZE(pool->ring_pages); i++) {
+		struct page *page;
+
+		page = shmem_read_mapping_page(pool->f->f_mapping, i);
+		if (IS_ERR(page)) {
+			kdbus_pool_ring_exit(pool);
+			return PTR_ERR(page);
+		}
+
+		pool->ring_pages[i] = page;
+	}
+
+	pool->ring_count = (PAGE_SIZE - sizeof(struct kdbus_pool_ring)) /
+			   sizeof(u64);
+
+	ring = kmap_atomic(pool->ring_pages[0]);
+	ring->count = pool->ring_count;
+	ring->release_offset = PAGE_SIZE;
+	kunmap_atomic(ring);
+	set_page_dirty(pool->ring_pages[0]);
+
+	pool->reserved = 2 * PAGE_SIZE;
+	pool->flags |= KDBUS_POOL_RING;
+	return 0;
 }
 
-int kdbus_pool_init(struct kdbus_pool **pool, size_t size)
+int kdbus_pool_init(struct kdbus_pool **pool, size_t size,
+		    unsigned int flags)
 {
 	struct kdbus_pool *p;
 	struct file *f;
 	struct kdbus_slice *s;
+	unsigned int i;
 	int ret;
 
 	p = kzalloc(sizeof(struct kdbus_pool), GFP_KERNEL);
@@ -280,27 +609,77 @@ int kdbus_pool_init(struct kdbus_pool **pool, size_t size)
 		goto exit_free_p;
 	}
 
-	/* allocate first slice spanning the entire pool */
-	s = kdbus_pool_slice_new(0, size);
-	if (!s) {
-		ret = -ENOMEM;
-		goto exit_put_shmem;
-	}
-
+	mutex_init(&p->lock);
 	p->f = f;
 	p->size = size;
+	p->page_size = PAGE_SIZE;
+
+	/* A huge page pool is made of entire huge pages. Huge pages are
+	 * used if shmem supports them, otherwise the pool falls back to
+	 * normal pages; the caller can tell from the flags of the pool.
+	 * The pool is grown and released in units of huge pages, to not
+	 * split them up. */
+	if (flags & KDBUS_POOL_HUGEPAGE) {
+		if (!IS_ALIGNED(size, PMD_SIZE)) {
+			ret = -EINVAL;
+			goto exit_put_shmem;
+		}
+
+#ifdef CONFIG_TRANSPARENT_HUGE_PAGECACHE
+		if (has_transparent_hugepage()) {
+			p->flags |= KDBUS_POOL_HUGEPAGE;
+			p->page_size = HPAGE_PMD_SIZE;
+		}
+#endif
+	}
+
+	p->active = min(size, max_t(size_t, KDBUS_POOL_ACTIVE_MIN,
+				    p->page_size));
 	p->busy = 0;
-	p->slices_free = RB_ROOT;
-	p->slices_busy = RB_ROOT;
+
+	p->slices_busy_bits = kdbus_pool_busy_bits(p->active);
+	p->slices_busy = kdbus_pool_busy_new(p->slices_busy_bits);
+	if (!p->slices_busy) {
+		ret = -ENOMEM;
+		goto exit_put_shmem;
+	}
 
 	INIT_LIST_HEAD(&p->slices);
+	INIT_LIST_HEAD(&p->slices_spare);
+	for (i = 0; i < KDBUS_POOL_CLASSES; i++)
+		INIT_LIST_HEAD(&p->slices_free[i]);
+
+	if (flags & KDBUS_POOL_LOCKED) {
+		ret = kdbus_pool_lock_check(size);
+		if (ret < 0)
+			goto exit_put_shmem;
+
+		p->flags |= KDBUS_POOL_LOCKED;
+	}
+
+	if (flags & KDBUS_POOL_RING) {
+		ret = kdbus_pool_ring_init(p);
+		if (ret < 0)
+			goto exit_put_shmem;
+	}
+
+	/* allocate first slice spanning the active part of the pool */
+	s = kdbus_pool_slice_new(p, p->reserved, p->active - p->reserved);
+	if (!s) {
+		ret = -ENOMEM;
+		goto exit_ring;
+	}
+
 	list_add(&s->entry, &p->slices);
 
 	kdbus_pool_add_free_slice(p, s);
 	*pool = p;
 	return 0;
 
+exit_ring:
+	kdbus_pool_ring_exit(p);
 exit_put_shmem:
+	kfree(p->slices_busy);
 	fput(f);
 exit_free_p:
 	kfree(p);
@@ -316,16 +695,30 @@ void kdbus_pool_cleanup(struct kdbus_pool *pool)
 
 	list_for_each_entry_safe(s, tmp, &pool->slices, entry) {
 		list_del(&s->entry);
-		kfree(s);
+		kmem_cache_free(kdbus_slice_cache, s);
 	}
 
+	list_for_each_entry_safe(s, tmp, &pool->slices_spare, entry) {
+		list_del(&s->entry);
+		kmem_cache_free(kdbus_slice_cache, s);
+	}
+
+	kdbus_pool_ring_exit(pool);
+	kfree(pool->slices_busy);
 	fput(pool->f);
 	kfree(pool);
 }
 
+/* a snapshot, the allocations of other senders are not waited for */
 size_t kdbus_pool_remain(const struct kdbus_pool *pool)
 {
-	return pool->size - pool->busy;
+	return pool->size - pool->reserved - ACCESS_ONCE(pool->busy);
+}
+
+/* the properties the pool was set up with, KDBUS_POOL_* */
+unsigned int kdbus_pool_flags(const struct kdbus_pool *pool)
+{
+	return pool->flags;
 }
 
 /* allocate a message of the given size in the receiver's pool */
@@ -334,22 +727,20 @@ int kdbus_pool_alloc(struct kdbus_pool *pool, size_t size, size_t *off)
 	struct kdbus_slice *s;
 	int ret;
 
+	mutex_lock(&pool->lock);
 	ret = kdbus_pool_alloc_slice(pool, size, &s);
-	if (ret < 0)
-		return ret;
+	if (ret == 0)
+		*off = s->off;
+	mutex_unlock(&pool->lock);
 
-	*off = s->off;
-	return 0;
+	return ret;
 }
 
-/* free the allocated message */
-int kdbus_pool_free(struct kdbus_pool *pool, size_t off)
+/* free the message at the given offset; called with pool->lock held */
+static int kdbus_pool_free_off(struct kdbus_pool *pool, size_t off)
 {
 	struct kdbus_slice *slice;
 
-	if (!pool)
-		return 0;
-
 	if (off >= pool->size)
 		return -EINVAL;
 
@@ -361,39 +752,320 @@ int kdbus_pool_free(struct kdbus_pool *pool, size_t off)
 	return 0;
 }
 
+/* free the allocated message */
+int kdbus_pool_free(struct kdbus_pool *pool, size_t off)
+{
+	int ret;
+
+	if (!pool)
+		return 0;
+
+	mutex_lock(&pool->lock);
+	ret = kdbus_pool_free_off(pool, off);
+	mutex_unlock(&pool->lock);
+
+	return ret;
+}
+
+/* Free all messages at the given offsets with a single pool->lock;
+ * every valid offset is freed, the last error is returned. */
+int kdbus_pool_free_batch(struct kdbus_pool *pool,
+			  const u64 *offs, size_t count)
+{
+	size_t i;
+	int ret = 0;
+
+	if (!pool)
+		return 0;
+
+	mutex_lock(&pool->lock);
+	for (i = 0; i < count; i++) {
+		int r;
+
+		r = kdbus_pool_free_off(pool, offs[i]);
+		if (r < 0)
+			ret = r;
+	}
+	mutex_unlock(&pool->lock);
+
+	return ret;
+}
+
+/* Publish a message in the receive ring; the receiver reads the ring
+ * from its mapping of the pool without entering the kernel. */
+int kdbus_pool_ring_push(struct kdbus_pool *pool, u64 entry)
+{
+	struct kdbus_pool_ring *ring;
+
+	mutex_lock(&pool->lock);
+	if (pool->ring_head - pool->ring_tail >= pool->ring_count) {
+		mutex_unlock(&pool->lock);
+		return -ENOBUFS;
+	}
+
+	ring = kmap_atomic(pool->ring_pages[0]);
+	ring->entries[pool->ring_head % pool->ring_count] = entry;
+
+	/* the entry needs to be visible before the new head */
+	smp_wmb();
+	pool->ring_head++;
+	ring->head = pool->ring_head;
+	kunmap_atomic(ring);
+
+	flush_dcache_page(pool->ring_pages[0]);
+	set_page_dirty(pool->ring_pages[0]);
+	mutex_unlock(&pool->lock);
+	return 0;
+}
+
+/* Collect the number of receive entries the receiver consumed since
+ * the last call; a value from the receiver beyond the published
+ * entries is ignored. */
+unsigned int kdbus_pool_ring_pull(struct kdbus_pool *pool)
+{
+	struct kdbus_pool_release_ring *release;
+	u64 tail, n;
+
+	release = kmap_atomic(pool->ring_pages[1]);
+	tail = ACCESS_ONCE(release->tail);
+	kunmap_atomic(release);
+
+	mutex_lock(&pool->lock);
+	n = tail - pool->ring_tail;
+	if (n > pool->ring_head - pool->ring_tail)
+		n = 0;
+	pool->ring_tail += n;
+	mutex_unlock(&pool->lock);
+
+	return n;
+}
+
+/* The number of receive entries the receiver did not consume yet; a
+ * snapshot without taking the lock of the pool. */
+u64 kdbus_pool_ring_pending(struct kdbus_pool *pool)
+{
+	struct kdbus_pool_release_ring *release;
+	u64 head, tail;
+
+	release = kmap_atomic(pool->ring_pages[1]);
+	tail = ACCESS_ONCE(release->tail);
+	kunmap_atomic(release);
+
+	head = ACCESS_ONCE(pool->ring_head);
+	if (tail > head)
+		return 0;
+
+	return head - tail;
+}
+
+/* the first published entry was handed out by KDBUS_CMD_MSG_RECV */
+void kdbus_pool_ring_advance(struct kdbus_pool *pool)
+{
+	mutex_lock(&pool->lock);
+	pool->ring_tail++;
+	mutex_unlock(&pool->lock);
+}
+
+/* free all messages published by the receiver in the release ring */
+void kdbus_pool_ring_release(struct kdbus_pool *pool)
+{
+	struct kdbus_pool_release_ring *release;
+	struct kdbus_pool_ring *ring;
+	u64 head, n;
+
+	release = kmap_atomic(pool->ring_pages[1]);
+	head = ACCESS_ONCE(release->head);
+	kunmap_atomic(release);
+
+	mutex_lock(&pool->lock);
+	n = head - pool->ring_released;
+	if (n == 0 || n > pool->ring_count) {
+		mutex_unlock(&pool->lock);
+		return;
+	}
+
+	/* read the entries only after the head */
+	smp_rmb();
+
+	while (n-- > 0) {
+		u64 off;
+
+		release = kmap_atomic(pool->ring_pages[1]);
+		off = release->entries[pool->ring_released %
+				       pool->ring_count];
+		kunmap_atomic(release);
+
+		kdbus_pool_free_off(pool, off);
+		pool->ring_released++;
+	}
+
+	/* tell the receiver about the free entries in the release ring */
+	ring = kmap_atomic(pool->ring_pages[0]);
+	ring->released = pool->ring_released;
+	kunmap_atomic(ring);
+
+	flush_dcache_page(pool->ring_pages[0]);
+	set_page_dirty(pool->ring_pages[0]);
+	mutex_unlock(&pool->lock);
+}
+
+/* The pool is written page by page, directly into the pages of the
+ * shmem file. A page stays mapped while it is written, so a message
+ * written in a single pass looks up every page only once. */
+struct kdbus_pool_cursor {
+	struct address_space *mapping;
+	struct page *page;
+	char *addr;
+	size_t off;
+};
+
+static void kdbus_pool_cursor_put(struct kdbus_pool_cursor *c)
+{
+	if (!c->page)
+		return;
+
+	flush_dcache_page(c->page);
+	kunmap(c->page);
+	set_page_dirty(c->page);
+	mark_page_accessed(c->page);
+	page_cache_release(c->page);
+	c->page = NULL;
+}
+
+/* map the page for the current position of the cursor */
+static int kdbus_pool_cursor_get(struct kdbus_pool_cursor *c)
+{
+	pgoff_t index = c->off >> PAGE_CACHE_SHIFT;
+	struct page *page;
+
+	if (c->page && c->page->index == index)
+		return 0;
+
+	kdbus_pool_cursor_put(c);
+
+	page = shmem_read_mapping_page(c->mapping, index);
+	if (IS_ERR(page))
+		return PTR_ERR(page);
+
+	c->page = page;
+	c->addr = kmap(page);
+	return 0;
+}
+
+/* copy a kernel or user buffer to the cursor position, a NULL
+ * buffer writes zero bytes */
+static int kdbus_pool_cursor_copy(struct kdbus_pool_cursor *c,
+				  const void *data, size_t len, bool user)
+{
+	while (len > 0) {
+		size_t pos = c->off & ~PAGE_CACHE_MASK;
+		size_t n = min_t(size_t, len, PAGE_CACHE_SIZE - pos);
+		int ret;
+
+		ret = kdbus_pool_cursor_get(c);
+		if (ret < 0)
+			return ret;
+
+		if (!data)
+			memset(c->addr + pos, 0, n);
+		else if (!user)
+			memcpy(c->addr + pos, data, n);
+		else if (copy_from_user(c->addr + pos,
+					(const void __user *)data, n))
+			return -EFAULT;
+
+		if (data)
+			data += n;
+		c->off += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/**
+ * kdbus_pool_writev() - write a message into the receiver's pool
+ * @pool:	The receiver's pool
+ * @off:	Offset in the pool to write to
+ * @kvec:	Kernel buffers to write
+ * @kvec_count:	Number of kernel buffers
+ * @iov:	User buffers to write after the kernel buffers
+ * @iov_count:	Number of user buffers
+ *
+ * All buffers are written in a single pass, contiguously, in the given
+ * order. A buffer with a NULL base writes zero bytes.
+ *
+ * Return: number of bytes written, < 0 on failure
+ */
+ssize_t kdbus_pool_writev(const struct kdbus_pool *pool, size_t off,
+			  const struct kvec *kvec, size_t kvec_count,
+			  const struct iovec *iov, size_t iov_count)
+{
+	struct kdbus_pool_cursor c = {
+		.mapping = pool->f->f_mapping,
+		.off = off,
+	};
+	size_t i;
+	int ret = 0;
+
+	for (i = 0; i < kvec_count; i++) {
+		ret = kdbus_pool_cursor_copy(&c, kvec[i].iov_base,
+					     kvec[i].iov_len, false);
+		if (ret < 0)
+			goto exit;
+	}
+
+	for (i = 0; i < iov_count; i++) {
+		ret = kdbus_pool_cursor_copy(&c, iov[i].iov_base,
+					     iov[i].iov_len, true);
+		if (ret < 0)
+			goto exit;
+	}
+
+exit:
+	kdbus_pool_cursor_put(&c);
+	if (ret < 0)
+		return ret;
+
+	return c.off - off;
+}
+
 /* write to the receiver's shmem file */
 ssize_t kdbus_pool_write_user(const struct kdbus_pool *pool, size_t off,
 			      void __user *data, size_t len)
 {
-	loff_t o = off;
+	struct iovec iov = {
+		.iov_base = data,
+		.iov_len = len,
+	};
 
-	return pool->f->f_op->write(pool->f, data, len, &o);
+	return kdbus_pool_writev(pool, off, NULL, 0, &iov, 1);
 }
 
 ssize_t kdbus_pool_write(const struct kdbus_pool *pool, size_t off,
 			 void *data, size_t len)
 {
-	loff_t o = off;
-	mm_segment_t old_fs;
-	void __user *p;
-	ssize_t ret;
-
-	old_fs = get_fs();
-	set_fs(get_ds());
+	struct kvec kvec = {
+		.iov_base = data,
+		.iov_len = len,
+	};
 
-	p = (void __force __user *)data;
-	ret = pool->f->f_op->write(pool->f, p, len, &o);
-
-	set_fs(old_fs);
-	return ret;
+	return kdbus_pool_writev(pool, off, &kvec, 1, NULL, 0);
 }
 
 /* map the shmem file for the receiver */
 int kdbus_pool_mmap(const struct kdbus_pool *pool, struct vm_area_struct *vma)
 {
-	/* deny write access to the pool */
-	if (vma->vm_flags & VM_WRITE)
-		return -EPERM;
+	/* deny write access to the pool, except for a mapping of only
+	 * the release ring */
+	if (vma->vm_flags & VM_WRITE) {
+		if (!(pool->flags & KDBUS_POOL_RING))
+			return -EPERM;
+
+		if (vma->vm_pgoff != 1 ||
+		    vma->vm_end - vma->vm_start != PAGE_SIZE)
+			return -EPERM;
+	}
 
 	/* do not allow to map more than the size of the file */
 	if ((vma->vm_end - vma->vm_start) > pool->size)
@@ -404,5 +1076,46 @@ int kdbus_pool_mmap(const struct kdbus_pool *pool, struct vm_area_struct *vma)
 		fput(vma->vm_file);
 	vma->vm_file = get_file(pool->f);
 
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+	if (pool->flags & KDBUS_POOL_HUGEPAGE)
+		vma->vm_flags |= VM_HUGEPAGE;
+#endif
+
+	/* A locked pool is only mapped with MAP_LOCKED; mmap() checks
+	 * and charges the RLIMIT_MEMLOCK of the caller, and faults in and
+	 * locks all pages before it returns. */
+	if ((pool->flags & KDBUS_POOL_LOCKED) && !(vma->vm_flags & VM_LOCKED))
+		return -EPERM;
+
 	return pool->f->f_op->mmap(pool->f, vma);
 }
+
+/* find an address to map the pool at; a huge page pool is mapped at a
+ * huge page aligned address, to allow the use of huge page mappings */
+unsigned long kdbus_pool_get_unmapped_area(const struct kdbus_pool *pool,
+					   unsigned long addr,
+					   unsigned long len,
+					   unsigned long pgoff,
+					   unsigned long flags)
+{
+	unsigned long (*get_area)(struct file *, unsigned long,
+				  unsigned long, unsigned long,
+				  unsigned long);
+	unsigned long off;
+
+	get_area = current->mm->get_unmapped_area;
+	if (pool->f->f_op->get_unmapped_area)
+		get_area = pool->f->f_op->get_unmapped_area;
+
+	if (!(pool->flags & KDBUS_POOL_HUGEPAGE) || (flags & MAP_FIXED) ||
+	    len < pool->page_size)
+		return get_area(pool->f, addr, len, pgoff, flags);
+
+	/* ask for a larger area and align the start of it */
+	off = (pgoff << PAGE_SHIFT) & (pool->page_size - 1);
+	addr = get_area(pool->f, 0, len + pool->page_size, pgoff, flags);
+	if (IS_ERR_VALUE(addr))
+		return addr;
+
+	return round_up(addr - off, pool->page_size) + off;
+}
@@ -14,17 +14,47 @@
 #define __KDBUS_POOL_H
 
 struct kdbus_pool;
+struct kvec;
+struct iovec;
 
-int kdbus_pool_init(struct kdbus_pool **pool, size_t size);
+int kdbus_pool_cache_init(void);
+void kdbus_pool_cache_exit(void);
+
+/* flags for kdbus_pool_init() */
+enum {
+	KDBUS_POOL_HUGEPAGE		= 1 << 0,
+	KDBUS_POOL_LOCKED		= 1 << 1,
+	KDBUS_POOL_RING			= 1 << 2,
+};
+
+int kdbus_pool_init(struct kdbus_pool **pool, size_t size,
+		    unsigned int flags);
 void kdbus_pool_cleanup(struct kdbus_pool *pool);
 
 int kdbus_pool_alloc(struct kdbus_pool *pool, size_t size, size_t *off);
 int kdbus_pool_free(struct kdbus_pool *pool, size_t off);
+int kdbus_pool_free_batch(struct kdbus_pool *pool,
+			  const u64 *offs, size_t count);
 size_t kdbus_pool_remain(const struct kdbus_pool *pool);
+unsigned int kdbus_pool_flags(const struct kdbus_pool *pool);
+
+int kdbus_pool_ring_push(struct kdbus_pool *pool, u64 entry);
+unsigned int kdbus_pool_ring_pull(struct kdbus_pool *pool);
+u64 kdbus_pool_ring_pending(struct kdbus_pool *pool);
+void kdbus_pool_ring_advance(struct kdbus_pool *pool);
+void kdbus_pool_ring_release(struct kdbus_pool *pool);
 
+ssize_t kdbus_pool_writev(const struct kdbus_pool *pool, size_t off,
+			  const struct kvec *kvec, size_t kvec_count,
+			  const struct iovec *iov, size_t iov_count);
 ssize_t kdbus_pool_write(const struct kdbus_pool *pool, size_t off,
 			 void *data, size_t len);
 ssize_t kdbus_pool_write_user(const struct kdbus_pool *pool, size_t off,
 			 void __user *data, size_t len);
 int kdbus_pool_mmap(const struct kdbus_pool *pool, struct vm_area_struct *vma);
+unsigned long kdbus_pool_get_unmapped_area(const struct kdbus_pool *pool,
+					   unsigned long addr,
+					   unsigned long len,
+					   unsigned long pgoff,
+					   unsigned long flags);
 #endif
@@ -42,6 +42,12 @@ TABLE(CMD) = {
 	ENUM(KDBUS_CMD_HELLO),
 	ENUM(KDBUS_CMD_MSG_SEND),
 	ENUM(KDBUS_CMD_MSG_RECV),
+	ENUM(KDBUS_CMD_MSG_RELEASE),
+	ENUM(KDBUS_CMD_MSG_SUBMIT_RING),
+	ENUM(KDBUS_CMD_MSG_SUBMIT),
+	ENUM(KDBUS_CMD_MSG_RECV_BATCH),
+	ENUM(KDBUS_CMD_MSG_RELEASE_BATCH),
+	ENUM(KDBUS_CMD_MSG_CALL),
 	ENUM(KDBUS_CMD_NAME_ACQUIRE),
 	ENUM(KDBUS_CMD_NAME_RELEASE),
 	ENUM(KDBUS_CMD_NAME_LIST),
@@ -61,6 +67,8 @@ TABLE(MSG) = {
 	ENUM(KDBUS_MSG_FDS),
 	ENUM(KDBUS_MSG_BLOOM),
 	ENUM(KDBUS_MSG_DST_NAME),
+	ENUM(KDBUS_MSG_PRIORITY),
+	ENUM(KDBUS_MSG_SEND_TIMEOUT),
 	ENUM(KDBUS_MSG_SRC_CREDS),
 	ENUM(KDBUS_MSG_SRC_PID_COMM),
 	ENUM(KDBUS_MSG_SRC_TID_COMM),
@@ -30,7 +30,7 @@
 #include "kdbus-enum.h"
 
 #define POOL_SIZE (16 * 1024LU * 1024LU)
-struct conn *connect_to_bus(const char *path)
+struct conn *connect_to_bus(const char *path, uint64_t hello_flags)
 {
 	int fd, ret;
 	struct kdbus_cmd_hello __attribute__ ((__aligned__(8))) hello;
@@ -52,7 +52,8 @@ struct conn *connect_to_bus(const char *path)
 			   KDBUS_HELLO_ATTACH_CAPS |
 			   KDBUS_HELLO_ATTACH_CGROUP |
 			   KDBUS_HELLO_ATTACH_SECLABEL |
-			   KDBUS_HELLO_ATTACH_AUDIT;
+			   KDBUS_HELLO_ATTACH_AUDIT |
+			   hello_flags;
 	hello.size = sizeof(struct kdbus_cmd_hello);
 	hello.pool_size = POOL_SIZE;
 
@@ -69,7 +70,9 @@ struct conn *connect_to_bus(const char *path)
 		return NULL;
 	}
 
-	conn->buf = mmap(NULL, POOL_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	conn->buf = mmap(NULL, POOL_SIZE, PROT_READ,
+			 MAP_SHARED | (hello.conn_flags & KDBUS_HELLO_POOL_LOCKED ?
+				       MAP_LOCKED : 0), fd, 0);
 	if (conn->buf == MAP_FAILED) {
 		free(conn);
 		fprintf(stderr, "--- error mmap (%m)\n");
@@ -78,6 +81,7 @@ struct conn *connect_to_bus(const char *path)
 
 	conn->fd = fd;
 	conn->id = hello.id;
+	conn->flags = hello.conn_flags;
 	return conn;
 }
 
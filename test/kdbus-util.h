@@ -32,6 +32,7 @@ struct conn {
 	uint64_t id;
 	void *buf;
 	size_t size;
+	uint64_t flags;
 };
 
 int name_list(struct conn *conn);
@@ -41,7 +42,7 @@ int msg_recv(struct conn *conn);
 void msg_dump(const struct conn *conn, const struct kdbus_msg *msg);
 char *msg_id(uint64_t id, char *buf);
 int msg_send(const struct conn *conn, const char *name, uint64_t cookie, uint64_t dst_id);
-struct conn *connect_to_bus(const char *path);
+struct conn *connect_to_bus(const char *path, uint64_t hello_flags);
 void append_policy(struct kdbus_cmd_policy *cmd_policy, struct kdbus_policy *policy, __u64 max_size);
 struct kdbus_policy *make_policy_name(const char *name);
 struct kdbus_policy *make_policy_access(__u64 type, __u64 bits, __u64 id);
@@ -10,6 +10,7 @@
 #include <errno.h>
 #include <assert.h>
 #include <poll.h>
+#include <signal.h>
 #include <sys/time.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
@@ -24,6 +25,10 @@
 
 static char stress_payload[8192];
 
+/* sum of the received payload bytes, keeps the reads from being
+ * optimized away */
+static uint64_t payload_sum;
+
 struct stats {
 	uint64_t count;
 	uint64_t latency_acc;
@@ -190,7 +195,17 @@ handle_echo_reply(struct conn *conn)
 		}
 
 		case KDBUS_MSG_PAYLOAD_OFF: {
-			/* ignore */
+			const unsigned char *p;
+			uint64_t i;
+
+			/* read the payload from the pool like a real
+			 * receiver would; it is what --hugepage measures */
+			if (item->vec.offset == ~0ULL)
+				break;
+
+			p = (const unsigned char *)conn->buf + item->vec.offset;
+			for (i = 0; i < item->vec.size; i++)
+				payload_sum += p[i];
 			break;
 		}
 		}
@@ -205,6 +220,160 @@ handle_echo_reply(struct conn *conn)
 	return 0;
 }
 
+/* answer every call with an empty reply; runs in a child process */
+static int
+echo_server(struct conn *conn)
+{
+	struct kdbus_msg reply __attribute__ ((__aligned__(8)));
+	struct pollfd fd = { .fd = conn->fd, .events = POLLIN };
+
+	for (;;) {
+		const struct kdbus_msg *msg;
+		uint64_t dst_id, cookie;
+		uint64_t off;
+		int ret;
+
+		ret = poll(&fd, 1, -1);
+		if (ret < 0)
+			return EXIT_FAILURE;
+
+		ret = ioctl(conn->fd, KDBUS_CMD_MSG_RECV, &off);
+		if (ret < 0) {
+			if (errno == EAGAIN)
+				continue;
+
+			fprintf(stderr, "error receiving message: %d (%m)\n", ret);
+			return EXIT_FAILURE;
+		}
+
+		msg = (const struct kdbus_msg *)((char *)conn->buf + off);
+		dst_id = msg->src_id;
+		cookie = msg->cookie;
+
+		ret = ioctl(conn->fd, KDBUS_CMD_MSG_RELEASE, &off);
+		if (ret < 0) {
+			fprintf(stderr, "error free message: %d (%m)\n", ret);
+			return EXIT_FAILURE;
+		}
+
+		/* notifications are not answered */
+		if (dst_id == KDBUS_SRC_ID_KERNEL)
+			continue;
+
+		memset(&reply, 0, sizeof(reply));
+		reply.size = sizeof(reply);
+		reply.src_id = conn->id;
+		reply.dst_id = dst_id;
+		reply.cookie_reply = cookie;
+		reply.payload_type = KDBUS_PAYLOAD_DBUS1;
+
+		ret = ioctl(conn->fd, KDBUS_CMD_MSG_SEND, &reply);
+		if (ret < 0) {
+			fprintf(stderr, "error sending reply: %d (%m)\n", ret);
+			return EXIT_FAILURE;
+		}
+	}
+}
+
+/* send the payload with KDBUS_CMD_MSG_CALL and wait for the reply */
+static int
+call_echo(struct conn *conn, uint64_t dst_id, uint64_t cookie)
+{
+	struct kdbus_cmd_msg_call call;
+	struct kdbus_msg *msg;
+	struct kdbus_item *item;
+	struct timeval now;
+	uint64_t size;
+	int ret;
+
+	size = sizeof(struct kdbus_msg);
+	size += KDBUS_ITEM_SIZE(sizeof(struct kdbus_vec));
+
+	msg = malloc(size);
+	if (!msg) {
+		fprintf(stderr, "unable to malloc()!?\n");
+		return EXIT_FAILURE;
+	}
+
+	memset(msg, 0, size);
+	msg->size = size;
+	msg->src_id = conn->id;
+	msg->dst_id = dst_id;
+	msg->cookie = cookie;
+	msg->payload_type = KDBUS_PAYLOAD_DBUS1;
+
+	item = msg->items;
+	item->type = KDBUS_MSG_PAYLOAD_VEC;
+	item->size = KDBUS_PART_HEADER_SIZE + sizeof(struct kdbus_vec);
+	item->vec.address = (uint64_t) stress_payload;
+	item->vec.size = sizeof(stress_payload);
+
+	memset(&call, 0, sizeof(call));
+	call.msg_address = (uint64_t) msg;
+
+	gettimeofday(&now, NULL);
+	ret = ioctl(conn->fd, KDBUS_CMD_MSG_CALL, &call);
+	free(msg);
+	if (ret < 0) {
+		fprintf(stderr, "error calling: %d err %d (%m)\n", ret, errno);
+		return EXIT_FAILURE;
+	}
+
+	add_stats(&now);
+
+	ret = ioctl(conn->fd, KDBUS_CMD_MSG_RELEASE, &call.reply_offset);
+	if (ret < 0) {
+		fprintf(stderr, "error free message: %d (%m)\n", ret);
+		return EXIT_FAILURE;
+	}
+
+	return 0;
+}
+
+/* --call: measure the round trip of KDBUS_CMD_MSG_CALL to a peer
+ * answering in another process */
+static int
+call_loop(struct conn *conn_a, struct conn *conn_b)
+{
+	struct timeval start;
+	uint64_t cookie = 0;
+	pid_t pid;
+	int ret;
+
+	pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "fork() failed: %m\n");
+		return EXIT_FAILURE;
+	}
+
+	if (pid == 0)
+		_exit(echo_server(conn_a));
+
+	gettimeofday(&start, NULL);
+	reset_stats();
+
+	printf("-- entering call loop ...\n");
+
+	for (;;) {
+		struct timeval now;
+
+		ret = call_echo(conn_b, conn_a->id, ++cookie);
+		if (ret)
+			break;
+
+		gettimeofday(&now, NULL);
+		if (timeval_diff(&now, &start) / 1000ULL > 1000ULL) {
+			start.tv_sec = now.tv_sec;
+			start.tv_usec = now.tv_usec;
+			dump_stats();
+			reset_stats();
+		}
+	}
+
+	kill(pid, SIGTERM);
+	return ret;
+}
+
 int main(int argc, char *argv[])
 {
 	struct {
@@ -221,8 +390,20 @@ int main(int argc, char *argv[])
 	struct conn *conn_b;
 	struct pollfd fds[2];
 	struct timeval start;
+	uint64_t hello_flags = 0;
+	bool call = false;
 	unsigned int i;
 
+	for (i = 1; i < (unsigned int) argc; i++) {
+		/* --hugepage: back the pool of the receiver by huge pages */
+		if (strcmp(argv[i], "--hugepage") == 0)
+			hello_flags |= KDBUS_HELLO_POOL_HUGEPAGE;
+
+		/* --call: send with KDBUS_CMD_MSG_CALL and wait for replies */
+		if (strcmp(argv[i], "--call") == 0)
+			call = true;
+	}
+
 	for (i = 0; i < sizeof(stress_payload); i++)
 		stress_payload[i] = i;
 
@@ -253,11 +434,14 @@ int main(int argc, char *argv[])
 	if (asprintf(&bus, "/dev/kdbus/%s/bus", bus_make.name) < 0)
 		return EXIT_FAILURE;
 
-	conn_a = connect_to_bus(bus);
+	conn_a = connect_to_bus(bus, hello_flags);
 	if (!conn_a)
 		return EXIT_FAILURE;
 
-	conn_b = connect_to_bus(bus);
+	printf("-- receiver pool uses %s pages\n",
+	       conn_a->flags & KDBUS_HELLO_POOL_HUGEPAGE ? "huge" : "normal");
+
+	conn_b = connect_to_bus(bus, 0);
 	if (!conn_b)
 		return EXIT_FAILURE;
 
@@ -271,6 +455,11 @@ int main(int argc, char *argv[])
 
 	name_acquire(conn_a, SERVICE_NAME, 0);
 
+	if (call) {
+		ret = call_loop(conn_a, conn_b);
+		goto exit;
+	}
+
 	gettimeofday(&start, NULL);
 	reset_stats();
 
@@ -313,6 +502,7 @@ int main(int argc, char *argv[])
 		}
 	}
 
+exit:
 	printf("-- closing bus connections\n");
 
 	close(conn_a->fd);
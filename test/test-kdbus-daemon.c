@@ -61,7 +61,7 @@ int main(int argc, char *argv[])
 	if (asprintf(&bus, "/dev/kdbus/%s/bus", bus_make.name) < 0)
 		return EXIT_FAILURE;
 
-	conn = connect_to_bus(bus);
+	conn = connect_to_bus(bus, 0);
 	if (!conn)
 		return EXIT_FAILURE;
 	printf("  Created connection %llu on bus '%s'\n", (unsigned long long)conn->id, bus_make.name);
@@ -125,7 +125,7 @@ static int make_bus(void)
 		return EXIT_FAILURE;
 
 	for (ret = 0; ret < random() % 20; ret++) {
-		struct conn *conn = connect_to_bus(bus);
+		struct conn *conn = connect_to_bus(bus, 0);
 		if (conn)
 			add_fd(conn->fd);
 	}
@@ -150,7 +150,7 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
-	conn = connect_to_bus(bus);
+	conn = connect_to_bus(bus, 0);
 	if (!conn)
 		return EXIT_FAILURE;
 
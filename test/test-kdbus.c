@@ -10,6 +10,9 @@
 #include <assert.h>
 #include <poll.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
 
 //#include "include/uapi/kdbus/kdbus.h"
 #include "../kdbus.h"
@@ -17,7 +20,21 @@
 #include "kdbus-util.h"
 #include "kdbus-enum.h"
 
-int main(int argc, char *argv[])
+#define POOL_SIZE (16 * 1024LU * 1024LU)
+
+static char payload[1024 * 1024];
+
+/* the connections of a check; conn_b receives the messages, and is
+ * connected with the pool flags of the check */
+struct test {
+	struct conn *conn_a;
+	struct conn *conn_b;
+	struct conn *conn_c;
+};
+
+/* create the bus <uid>-<name> on a new control connection; the bus
+ * goes away when the returned control connection is closed */
+static int make_bus(const char *name, uint64_t flags, char **bus)
 {
 	struct {
 		struct kdbus_cmd_bus_make head;
@@ -27,23 +44,21 @@ int main(int argc, char *argv[])
 		uint64_t n_type;
 		char name[64];
 	} __attribute__ ((__aligned__(8))) bus_make;
-	int fdc, ret, cookie;
-	char *bus;
-	struct conn *conn_a, *conn_b;
-	struct pollfd fds[2];
-	int count;
+	int fdc, ret;
 
 	printf("-- opening /dev/kdbus/control\n");
 	fdc = open("/dev/kdbus/control", O_RDWR|O_CLOEXEC);
 	if (fdc < 0) {
 		fprintf(stderr, "--- error %d (%m)\n", fdc);
-		return EXIT_FAILURE;
+		return -1;
 	}
 
 	memset(&bus_make, 0, sizeof(bus_make));
 	bus_make.head.bloom_size = 64;
+	bus_make.head.flags = flags;
 
-	snprintf(bus_make.name, sizeof(bus_make.name), "%u-testbus", getuid());
+	snprintf(bus_make.name, sizeof(bus_make.name), "%u-%s",
+		 getuid(), name);
 	bus_make.n_type = KDBUS_MAKE_NAME;
 	bus_make.n_size = KDBUS_PART_HEADER_SIZE + strlen(bus_make.name) + 1;
 
@@ -54,14 +69,1460 @@ int main(int argc, char *argv[])
 	ret = ioctl(fdc, KDBUS_CMD_BUS_MAKE, &bus_make);
 	if (ret) {
 		fprintf(stderr, "--- error %d (%m)\n", ret);
+		close(fdc);
+		return -1;
+	}
+
+	if (asprintf(bus, "/dev/kdbus/%s/bus", bus_make.name) < 0) {
+		close(fdc);
+		return -1;
+	}
+
+	return fdc;
+}
+
+/* a message with one payload vector, and an optional item which
+ * carries a 64 bit value; broadcasts carry an empty bloom filter */
+static struct kdbus_msg *make_msg(const struct conn *conn, uint64_t dst_id,
+				  uint64_t cookie, uint64_t type,
+				  uint64_t value, size_t payload_size)
+{
+	struct kdbus_msg *msg;
+	struct kdbus_item *item;
+	uint64_t size;
+
+	size = sizeof(struct kdbus_msg);
+	size += KDBUS_ITEM_SIZE(sizeof(struct kdbus_vec));
+	if (type)
+		size += KDBUS_ITEM_SIZE(sizeof(uint64_t));
+	if (dst_id == KDBUS_DST_ID_BROADCAST)
+		size += KDBUS_ITEM_SIZE(64);
+
+	msg = malloc(size);
+	if (!msg) {
+		fprintf(stderr, "unable to malloc()!?\n");
+		return NULL;
+	}
+
+	memset(msg, 0, size);
+	msg->size = size;
+	msg->src_id = conn->id;
+	msg->dst_id = dst_id;
+	msg->cookie = cookie;
+	msg->payload_type = KDBUS_PAYLOAD_DBUS1;
+
+	item = msg->items;
+
+	if (type) {
+		item->type = type;
+		item->size = KDBUS_PART_HEADER_SIZE + sizeof(uint64_t);
+		item->data64[0] = value;
+		item = KDBUS_PART_NEXT(item);
+	}
+
+	if (dst_id == KDBUS_DST_ID_BROADCAST) {
+		item->type = KDBUS_MSG_BLOOM;
+		item->size = KDBUS_PART_HEADER_SIZE + 64;
+		item = KDBUS_PART_NEXT(item);
+	}
+
+	item->type = KDBUS_MSG_PAYLOAD_VEC;
+	item->size = KDBUS_PART_HEADER_SIZE + sizeof(struct kdbus_vec);
+	item->vec.address = (uint64_t)payload;
+	item->vec.size = payload_size;
+
+	return msg;
+}
+
+/* send a message; a failed send returns -1 with errno set */
+static int send_msg(const struct conn *conn, uint64_t dst_id,
+		    uint64_t cookie, uint64_t type, uint64_t value,
+		    size_t payload_size)
+{
+	struct kdbus_msg *msg;
+	int ret;
+
+	msg = make_msg(conn, dst_id, cookie, type, value, payload_size);
+	if (!msg)
+		return -1;
+
+	ret = ioctl(conn->fd, KDBUS_CMD_MSG_SEND, msg);
+	free(msg);
+
+	return ret;
+}
+
+/* send a message which expects a reply within timeout_ns, or without
+ * a timeout if it is 0 */
+static int send_expect_reply(const struct conn *conn, uint64_t dst_id,
+			     uint64_t cookie, uint64_t timeout_ns)
+{
+	struct kdbus_msg *msg;
+	int ret;
+
+	msg = make_msg(conn, dst_id, cookie, 0, 0, 8);
+	if (!msg)
+		return -1;
+
+	msg->flags = KDBUS_MSG_FLAGS_EXPECT_REPLY;
+	msg->timeout_ns = timeout_ns;
+
+	ret = ioctl(conn->fd, KDBUS_CMD_MSG_SEND, msg);
+	free(msg);
+
+	return ret;
+}
+
+/* receive and release the next message, and return its cookie; a
+ * failed receive returns -1 with errno set */
+static int recv_cookie(const struct conn *conn, uint64_t *cookie)
+{
+	const struct kdbus_msg *msg;
+	uint64_t off;
+	int ret;
+
+	ret = ioctl(conn->fd, KDBUS_CMD_MSG_RECV, &off);
+	if (ret < 0)
+		return ret;
+
+	msg = (const struct kdbus_msg *)((const char *)conn->buf + off);
+	*cookie = msg->cookie;
+
+	return ioctl(conn->fd, KDBUS_CMD_MSG_RELEASE, &off);
+}
+
+/* receive and release the next message, which needs to be a reply
+ * notification of the kernel; returns its type and the cookie of the
+ * call it is for */
+static int recv_notify(const struct conn *conn, uint64_t *type,
+		       uint64_t *cookie_reply)
+{
+	const struct kdbus_msg *msg;
+	uint64_t off;
+	int ret;
+
+	ret = ioctl(conn->fd, KDBUS_CMD_MSG_RECV, &off);
+	if (ret < 0)
+		return ret;
+
+	msg = (const struct kdbus_msg *)((const char *)conn->buf + off);
+	*type = msg->src_id == KDBUS_SRC_ID_KERNEL ? msg->items[0].type : 0;
+	*cookie_reply = msg->cookie_reply;
+
+	return ioctl(conn->fd, KDBUS_CMD_MSG_RELEASE, &off);
+}
+
+/* send large messages until the receiver runs out of space; returns
+ * the number of sent messages */
+static int fill_conn(const struct conn *conn, const struct conn *conn_dst)
+{
+	int i;
+
+	for (i = 0; i < 1024; i++) {
+		if (send_msg(conn, conn_dst->id, i + 1, 0, 0,
+			     sizeof(payload)) == 0)
+			continue;
+
+		if (errno != ENOBUFS && errno != EXFULL) {
+			fprintf(stderr, "--- error sending message: %m\n");
+			return -1;
+		}
+
+		return i;
+	}
+
+	fprintf(stderr, "--- receiver does not run out of space\n");
+	return -1;
+}
+
+/* the number of resident pages of a mapping, or -1 */
+static int count_resident(void *buf, size_t size)
+{
+	unsigned char *vec;
+	size_t i, pages = size / getpagesize();
+	int n = 0;
+
+	vec = malloc(pages);
+	if (!vec)
+		return -1;
+
+	if (mincore(buf, size, vec) < 0) {
+		fprintf(stderr, "--- error mincore: %m\n");
+		free(vec);
+		return -1;
+	}
+
+	for (i = 0; i < pages; i++)
+		if (vec[i] & 1)
+			n++;
+
+	free(vec);
+	return n;
+}
+
+/* connect with the given pool flags and size, without mapping the
+ * pool; returns the connection, or -1 with errno set */
+static int hello_pool(const char *bus, uint64_t flags, uint64_t size)
+{
+	struct kdbus_cmd_hello __attribute__ ((__aligned__(8))) hello;
+	int fd, err;
+
+	fd = open(bus, O_RDWR|O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	memset(&hello, 0, sizeof(hello));
+	hello.size = sizeof(hello);
+	hello.conn_flags = flags;
+	hello.pool_size = size;
+
+	if (ioctl(fd, KDBUS_CMD_HELLO, &hello) < 0) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	return fd;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void free_conn(struct conn *conn)
+{
+	if (!conn)
+		return;
+
+	munmap(conn->buf, POOL_SIZE);
+	close(conn->fd);
+	free(conn);
+}
+
+/* connect the three connections of a check */
+static int test_init(struct test *t, const char *bus, uint64_t flags)
+{
+	t->conn_a = connect_to_bus(bus, 0);
+	t->conn_b = connect_to_bus(bus, flags);
+	t->conn_c = connect_to_bus(bus, 0);
+	if (t->conn_a && t->conn_b && t->conn_c)
+		return EXIT_SUCCESS;
+
+	free_conn(t->conn_a);
+	free_conn(t->conn_b);
+	free_conn(t->conn_c);
+	return EXIT_FAILURE;
+}
+
+/* disconnect the connections of a check; a connection which the check
+ * closed itself is NULL */
+static void test_exit(struct test *t)
+{
+	free_conn(t->conn_a);
+	free_conn(t->conn_b);
+	free_conn(t->conn_c);
+}
+
+/* The pool grows with the messages it holds, and gives back the pages
+ * of released messages beyond its start. */
+static int check_pool_grow(const char *bus)
+{
+	struct test t;
+	uint64_t i, off[2];
+	int n, ret = EXIT_FAILURE;
+
+	printf("-- checking pool growth and release\n");
+
+	if (test_init(&t, bus, 0) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	for (i = 0; i < ELEMENTSOF(off); i++) {
+		if (send_msg(t.conn_a, t.conn_b->id, i + 1, 0, 0,
+			     sizeof(payload)) < 0) {
+			fprintf(stderr, "--- error sending message: %m\n");
+			goto exit;
+		}
+
+		if (ioctl(t.conn_b->fd, KDBUS_CMD_MSG_RECV, &off[i]) < 0) {
+			fprintf(stderr, "--- error receiving message: %m\n");
+			goto exit;
+		}
+	}
+
+	n = count_resident((char *)t.conn_b->buf + sizeof(payload),
+			   2 * sizeof(payload));
+	if (n <= 0) {
+		fprintf(stderr, "--- pool did not grow\n");
+		goto exit;
+	}
+
+	for (i = 0; i < ELEMENTSOF(off); i++)
+		ioctl(t.conn_b->fd, KDBUS_CMD_MSG_RELEASE, &off[i]);
+
+	n = count_resident((char *)t.conn_b->buf + sizeof(payload),
+			   POOL_SIZE - sizeof(payload));
+	if (n != 0) {
+		fprintf(stderr, "--- %d pages resident after release\n", n);
+		goto exit;
+	}
+
+	ret = EXIT_SUCCESS;
+
+exit:
+	test_exit(&t);
+	return ret;
+}
+
+/* A huge page pool needs a size of entire huge pages; it falls back to
+ * normal pages if there are no huge pages for it. */
+static int check_pool_hugepage(const char *bus)
+{
+	struct test t;
+	uint64_t cookie;
+	int fd, ret = EXIT_FAILURE;
+
+	printf("-- checking huge page pools\n");
+
+	fd = hello_pool(bus, KDBUS_HELLO_POOL_HUGEPAGE,
+			POOL_SIZE + getpagesize());
+	if (fd >= 0 || errno != EINVAL) {
+		fprintf(stderr, "--- misaligned huge page pool accepted\n");
+		if (fd >= 0)
+			close(fd);
+		return EXIT_FAILURE;
+	}
+
+	if (test_init(&t, bus, KDBUS_HELLO_POOL_HUGEPAGE) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	if (!(t.conn_b->flags & KDBUS_HELLO_POOL_HUGEPAGE))
+		printf("--- no huge pages, the pool uses normal pages\n");
+
+	if (send_msg(t.conn_a, t.conn_b->id, 1, 0, 0, sizeof(payload)) < 0) {
+		fprintf(stderr, "--- error sending message: %m\n");
+		goto exit;
+	}
+
+	if (recv_cookie(t.conn_b, &cookie) < 0 || cookie != 1) {
+		fprintf(stderr, "--- error receiving message: %m\n");
+		goto exit;
+	}
+
+	ret = EXIT_SUCCESS;
+
+exit:
+	test_exit(&t);
+	return ret;
+}
+
+/* A locked pool can only be mapped with MAP_LOCKED, and is resident
+ * once it is mapped. */
+static int check_pool_locked(const char *bus)
+{
+	void *buf;
+	int fd, n, ret = EXIT_FAILURE;
+
+	printf("-- checking locked pools\n");
+
+	fd = hello_pool(bus, KDBUS_HELLO_POOL_LOCKED, POOL_SIZE);
+	if (fd < 0) {
+		if (errno == ENOMEM) {
+			printf("--- pool exceeds RLIMIT_MEMLOCK, skipped\n");
+			return EXIT_SUCCESS;
+		}
+
+		fprintf(stderr, "--- error when saying hello: %m\n");
+		return EXIT_FAILURE;
+	}
+
+	buf = mmap(NULL, POOL_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	if (buf != MAP_FAILED || errno != EPERM) {
+		fprintf(stderr, "--- locked pool mapped without MAP_LOCKED\n");
+		if (buf != MAP_FAILED)
+			munmap(buf, POOL_SIZE);
+		goto exit;
+	}
+
+	buf = mmap(NULL, POOL_SIZE, PROT_READ, MAP_SHARED|MAP_LOCKED, fd, 0);
+	if (buf == MAP_FAILED) {
+		if (errno == EAGAIN) {
+			printf("--- pool exceeds RLIMIT_MEMLOCK, skipped\n");
+			ret = EXIT_SUCCESS;
+		} else {
+			fprintf(stderr, "--- error mmap (%m)\n");
+		}
+		goto exit;
+	}
+
+	n = count_resident(buf, POOL_SIZE);
+	if (n != (int)(POOL_SIZE / getpagesize()))
+		fprintf(stderr, "--- %d pages of the locked pool resident\n", n);
+	else
+		ret = EXIT_SUCCESS;
+
+	munmap(buf, POOL_SIZE);
+exit:
+	close(fd);
+	return ret;
+}
+
+/* The receiver reads the messages from the receive ring of its pool,
+ * and hands them back in the release ring, without KDBUS_CMD_MSG_RECV
+ * and KDBUS_CMD_MSG_RELEASE. */
+static int check_pool_ring(const char *bus)
+{
+	const struct kdbus_pool_ring *ring;
+	struct kdbus_pool_release_ring *release;
+	struct test t;
+	uint64_t i, off;
+	int ret = EXIT_FAILURE;
+
+	printf("-- checking the receive ring\n");
+
+	if (test_init(&t, bus, KDBUS_HELLO_POOL_RING) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	ring = t.conn_b->buf;
+	release = mmap(NULL, getpagesize(), PROT_READ|PROT_WRITE,
+		       MAP_SHARED, t.conn_b->fd, ring->release_offset);
+	if (release == MAP_FAILED) {
+		fprintf(stderr, "--- error mmap release ring (%m)\n");
+		goto exit;
+	}
+
+	for (i = 1; i <= 3; i++) {
+		if (send_msg(t.conn_a, t.conn_b->id, i, 0, 0, 8) < 0) {
+			fprintf(stderr, "--- error sending message: %m\n");
+			goto exit_unmap;
+		}
+	}
+
+	if (ring->head != 3) {
+		fprintf(stderr, "--- ring head %llu, expected 3\n",
+			(unsigned long long)ring->head);
+		goto exit_unmap;
+	}
+
+	/* the messages are published in the order they are sent */
+	for (i = 0; i < 3; i++) {
+		const struct kdbus_msg *msg;
+
+		off = ring->entries[i % ring->count];
+		if (off & KDBUS_POOL_RING_RECV) {
+			fprintf(stderr, "--- entry %llu needs RECV\n",
+				(unsigned long long)i);
+			goto exit_unmap;
+		}
+
+		msg = (const struct kdbus_msg *)((char *)t.conn_b->buf + off);
+		if (msg->cookie != i + 1) {
+			fprintf(stderr, "--- entry %llu has cookie %llu\n",
+				(unsigned long long)i,
+				(unsigned long long)msg->cookie);
+			goto exit_unmap;
+		}
+
+		release->entries[i % ring->count] = off;
+	}
+
+	/* consume and release all of them; the entries need to be
+	 * visible before the head */
+	release->tail = 3;
+	__sync_synchronize();
+	release->head = 3;
+
+	/* the kernel processes the rings on the next call */
+	if (ioctl(t.conn_b->fd, KDBUS_CMD_MSG_RECV, &off) == 0 ||
+	    errno != EAGAIN) {
+		fprintf(stderr, "--- consumed messages are received again\n");
+		goto exit_unmap;
+	}
+
+	if (ring->released != 3) {
+		fprintf(stderr, "--- ring released %llu, expected 3\n",
+			(unsigned long long)ring->released);
+		goto exit_unmap;
+	}
+
+	ret = EXIT_SUCCESS;
+
+exit_unmap:
+	munmap(release, getpagesize());
+exit:
+	test_exit(&t);
+	return ret;
+}
+
+/* The messages queued in the submission ring are sent with a single
+ * KDBUS_CMD_MSG_SUBMIT, and complete in the completion ring. */
+static int check_submit_ring(const char *bus)
+{
+	struct kdbus_submit_ring ring;
+	struct kdbus_submit_completion cq[4];
+	struct kdbus_cmd_submit_ring cmd;
+	struct kdbus_msg *msgs[3] = {};
+	uint64_t sq[4];
+	struct test t;
+	uint64_t i, off;
+	int n, ret = EXIT_FAILURE;
+
+	printf("-- checking the submission ring\n");
+
+	if (test_init(&t, bus, 0) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	if (ioctl(t.conn_a->fd, KDBUS_CMD_MSG_SUBMIT) == 0 || errno != ENXIO) {
+		fprintf(stderr, "--- submit without a ring succeeded\n");
+		goto exit;
+	}
+
+	memset(&ring, 0, sizeof(ring));
+	memset(cq, 0, sizeof(cq));
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.ring = (uint64_t)&ring;
+	cmd.sq = (uint64_t)sq;
+	cmd.cq = (uint64_t)cq;
+	cmd.count = ELEMENTSOF(sq);
+
+	if (ioctl(t.conn_a->fd, KDBUS_CMD_MSG_SUBMIT_RING, &cmd) < 0) {
+		fprintf(stderr, "--- error registering the ring: %m\n");
+		goto exit;
+	}
+
+	for (i = 0; i < ELEMENTSOF(msgs); i++) {
+		msgs[i] = make_msg(t.conn_a, t.conn_b->id, i + 1, 0, 0, 8);
+		if (!msgs[i])
+			goto exit_free;
+
+		sq[i] = (uint64_t)msgs[i];
+	}
+	ring.sq_head = ELEMENTSOF(msgs);
+
+	n = ioctl(t.conn_a->fd, KDBUS_CMD_MSG_SUBMIT);
+	if (n != (int)ELEMENTSOF(msgs)) {
+		fprintf(stderr, "--- submit returned %d (%m)\n", n);
+		goto exit_free;
+	}
+
+	if (ring.sq_tail != ELEMENTSOF(msgs) ||
+	    ring.cq_head != ELEMENTSOF(msgs)) {
+		fprintf(stderr, "--- ring sq_tail %llu cq_head %llu\n",
+			(unsigned long long)ring.sq_tail,
+			(unsigned long long)ring.cq_head);
+		goto exit_free;
+	}
+
+	for (i = 0; i < ELEMENTSOF(msgs); i++) {
+		if (cq[i].cookie != i + 1 || cq[i].ret != 0) {
+			fprintf(stderr, "--- completion %llu: cookie %llu ret %lld\n",
+				(unsigned long long)i,
+				(unsigned long long)cq[i].cookie,
+				(long long)cq[i].ret);
+			goto exit_free;
+		}
+	}
+	ring.cq_tail = ring.cq_head;
+
+	/* nothing new is submitted */
+	if (ioctl(t.conn_a->fd, KDBUS_CMD_MSG_SUBMIT) != 0) {
+		fprintf(stderr, "--- empty submit failed: %m\n");
+		goto exit_free;
+	}
+
+	/* a message at a misaligned address is not read, and completes
+	 * with an error */
+	sq[ring.sq_head % ELEMENTSOF(sq)] = (uint64_t)msgs[0] + 4;
+	ring.sq_head++;
+
+	n = ioctl(t.conn_a->fd, KDBUS_CMD_MSG_SUBMIT);
+	i = ring.cq_tail % ELEMENTSOF(cq);
+	if (n != 1 || cq[i].cookie != 0 || cq[i].ret != -EFAULT) {
+		fprintf(stderr, "--- misaligned message: ret %lld\n",
+			(long long)cq[i].ret);
+		goto exit_free;
+	}
+	ring.cq_tail = ring.cq_head;
+
+	for (i = 0; i < ELEMENTSOF(msgs); i++) {
+		if (ioctl(t.conn_b->fd, KDBUS_CMD_MSG_RECV, &off) < 0) {
+			fprintf(stderr, "--- message %llu not received: %m\n",
+				(unsigned long long)i);
+			goto exit_free;
+		}
+
+		ioctl(t.conn_b->fd, KDBUS_CMD_MSG_RELEASE, &off);
+	}
+
+	ret = EXIT_SUCCESS;
+
+exit_free:
+	for (i = 0; i < ELEMENTSOF(msgs); i++)
+		free(msgs[i]);
+exit:
+	test_exit(&t);
+	return ret;
+}
+
+/* Several messages are received and released with one call each; the
+ * offsets array is larger than the number of queued messages. */
+static int check_batch(const char *bus)
+{
+	struct {
+		struct kdbus_cmd_msg_batch head;
+		uint64_t offsets[8];
+	} batch;
+	struct test t;
+	uint64_t i, off;
+	int ret = EXIT_FAILURE;
+
+	printf("-- checking batch receive and release\n");
+
+	if (test_init(&t, bus, 0) != EXIT_SUCCESS)
 		return EXIT_FAILURE;
+
+	for (i = 1; i <= 4; i++) {
+		if (send_msg(t.conn_a, t.conn_b->id, i, 0, 0, 8) < 0) {
+			fprintf(stderr, "--- error sending message: %m\n");
+			goto exit;
+		}
+	}
+
+	memset(&batch, 0, sizeof(batch));
+	batch.head.size = sizeof(batch);
+
+	if (ioctl(t.conn_b->fd, KDBUS_CMD_MSG_RECV_BATCH, &batch) < 0) {
+		fprintf(stderr, "--- error receiving batch: %m\n");
+		goto exit;
+	}
+
+	if (batch.head.count != 4) {
+		fprintf(stderr, "--- received %llu messages, expected 4\n",
+			(unsigned long long)batch.head.count);
+		goto exit;
+	}
+
+	for (i = 0; i < batch.head.count; i++) {
+		const struct kdbus_msg *msg;
+
+		msg = (const struct kdbus_msg *)((char *)t.conn_b->buf +
+						 batch.offsets[i]);
+		if (msg->cookie != i + 1) {
+			fprintf(stderr, "--- message %llu has cookie %llu\n",
+				(unsigned long long)i,
+				(unsigned long long)msg->cookie);
+			goto exit;
+		}
 	}
 
-	if (asprintf(&bus, "/dev/kdbus/%s/bus", bus_make.name) < 0)
+	if (ioctl(t.conn_b->fd, KDBUS_CMD_MSG_RELEASE_BATCH, &batch) < 0) {
+		fprintf(stderr, "--- error releasing batch: %m\n");
+		goto exit;
+	}
+
+	/* the queue is empty, and the messages are gone */
+	if (ioctl(t.conn_b->fd, KDBUS_CMD_MSG_RECV, &off) == 0 ||
+	    errno != EAGAIN) {
+		fprintf(stderr, "--- message left in the queue\n");
+		goto exit;
+	}
+
+	if (ioctl(t.conn_b->fd, KDBUS_CMD_MSG_RELEASE,
+		  &batch.offsets[0]) == 0) {
+		fprintf(stderr, "--- message released twice\n");
+		goto exit;
+	}
+
+	ret = EXIT_SUCCESS;
+
+exit:
+	test_exit(&t);
+	return ret;
+}
+
+/* Messages of a higher priority are received first; messages of the
+ * same priority in the order they are sent. */
+static int check_priority(const char *bus)
+{
+	static const uint64_t prios[] = { 0, 7, 3, 7 };
+	static const uint64_t order[] = { 2, 4, 3, 1 };
+	struct test t;
+	uint64_t i, cookie, off;
+	int ret = EXIT_FAILURE;
+
+	printf("-- checking message priorities\n");
+
+	if (test_init(&t, bus, 0) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	for (i = 0; i < ELEMENTSOF(prios); i++) {
+		if (send_msg(t.conn_a, t.conn_b->id, i + 1,
+			     KDBUS_MSG_PRIORITY, prios[i], 8) < 0) {
+			fprintf(stderr, "--- error sending message: %m\n");
+			goto exit;
+		}
+	}
+
+	if (send_msg(t.conn_a, t.conn_b->id, 99,
+		     KDBUS_MSG_PRIORITY, 8, 8) == 0 || errno != EINVAL) {
+		fprintf(stderr, "--- invalid priority accepted\n");
+		goto exit;
+	}
+
+	for (i = 0; i < ELEMENTSOF(order); i++) {
+		if (recv_cookie(t.conn_b, &cookie) < 0) {
+			fprintf(stderr, "--- error receiving message: %m\n");
+			goto exit;
+		}
+
+		if (cookie != order[i]) {
+			fprintf(stderr, "--- received cookie %llu, expected %llu\n",
+				(unsigned long long)cookie,
+				(unsigned long long)order[i]);
+			goto exit;
+		}
+	}
+
+	if (ioctl(t.conn_b->fd, KDBUS_CMD_MSG_RECV, &off) == 0 ||
+	    errno != EAGAIN) {
+		fprintf(stderr, "--- message left in the queue\n");
+		goto exit;
+	}
+
+	ret = EXIT_SUCCESS;
+
+exit:
+	test_exit(&t);
+	return ret;
+}
+
+/* Calls which are not received expire at their deadlines, in the order
+ * of the deadlines, not in the order they are sent; the receiver never
+ * sees them. */
+static int check_deadlines(const char *bus)
+{
+	static const uint64_t timeouts_ms[] = { 300, 100, 200 };
+	static const uint64_t order[] = { 2, 3, 1 };
+	struct test t;
+	uint64_t i, type, cookie;
+	int ret = EXIT_FAILURE;
+
+	printf("-- checking message deadlines\n");
+
+	if (test_init(&t, bus, 0) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	for (i = 0; i < ELEMENTSOF(timeouts_ms); i++) {
+		if (send_expect_reply(t.conn_a, t.conn_b->id, i + 1,
+				      timeouts_ms[i] * 1000000ULL) < 0) {
+			fprintf(stderr, "--- error sending message: %m\n");
+			goto exit;
+		}
+	}
+
+	usleep(500 * 1000);
+
+	for (i = 0; i < ELEMENTSOF(order); i++) {
+		if (recv_notify(t.conn_a, &type, &cookie) < 0) {
+			fprintf(stderr, "--- timeout %llu not received: %m\n",
+				(unsigned long long)i);
+			goto exit;
+		}
+
+		if (type != KDBUS_MSG_REPLY_TIMEOUT || cookie != order[i]) {
+			fprintf(stderr, "--- received %llu for cookie %llu, expected timeout for %llu\n",
+				(unsigned long long)type,
+				(unsigned long long)cookie,
+				(unsigned long long)order[i]);
+			goto exit;
+		}
+	}
+
+	if (recv_cookie(t.conn_b, &cookie) == 0 || errno != EAGAIN) {
+		fprintf(stderr, "--- expired message received\n");
+		goto exit;
+	}
+
+	ret = EXIT_SUCCESS;
+
+exit:
+	test_exit(&t);
+	return ret;
+}
+
+/* The messages of concurrent senders are all queued, the ones of every
+ * sender in the order it sent them. */
+static int check_concurrent_send(const char *bus)
+{
+	struct conn *senders[4] = {};
+	uint64_t seq[ELEMENTSOF(senders)] = {};
+	struct test t;
+	uint64_t i, j, cookie;
+	pid_t pid;
+	int status;
+	int ret = EXIT_FAILURE;
+
+	printf("-- checking concurrent senders\n");
+
+	if (test_init(&t, bus, 0) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	for (i = 0; i < ELEMENTSOF(senders); i++) {
+		senders[i] = connect_to_bus(bus, 0);
+		if (!senders[i])
+			goto exit;
+	}
+
+	for (i = 0; i < ELEMENTSOF(senders); i++) {
+		pid = fork();
+		if (pid < 0) {
+			fprintf(stderr, "--- error fork: %m\n");
+			break;
+		}
+
+		if (pid > 0)
+			continue;
+
+		for (j = 1; j <= 8; j++)
+			if (send_msg(senders[i], t.conn_b->id,
+				     (i << 8) | j, 0, 0, 8) < 0)
+				_exit(EXIT_FAILURE);
+
+		_exit(EXIT_SUCCESS);
+	}
+
+	ret = EXIT_SUCCESS;
+	while (wait(&status) > 0)
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+			ret = EXIT_FAILURE;
+
+	if (ret != EXIT_SUCCESS || i != ELEMENTSOF(senders)) {
+		fprintf(stderr, "--- error sending messages\n");
+		ret = EXIT_FAILURE;
+		goto exit;
+	}
+
+	ret = EXIT_FAILURE;
+
+	for (i = 0; i < ELEMENTSOF(senders) * 8; i++) {
+		if (recv_cookie(t.conn_b, &cookie) < 0) {
+			fprintf(stderr, "--- message %llu not received: %m\n",
+				(unsigned long long)i);
+			goto exit;
+		}
+
+		j = cookie >> 8;
+		if (j >= ELEMENTSOF(senders) || (cookie & 0xff) != ++seq[j]) {
+			fprintf(stderr, "--- received cookie %llx out of order\n",
+				(unsigned long long)cookie);
+			goto exit;
+		}
+	}
+
+	if (recv_cookie(t.conn_b, &cookie) == 0 || errno != EAGAIN) {
+		fprintf(stderr, "--- message left in the queue\n");
+		goto exit;
+	}
+
+	ret = EXIT_SUCCESS;
+
+exit:
+	for (i = 0; i < ELEMENTSOF(senders); i++)
+		free_conn(senders[i]);
+	test_exit(&t);
+	return ret;
+}
+
+/* answer the next call on conn_b, after a reply from conn_c which
+ * carries the same cookie */
+static int call_answer(const struct conn *conn_b, const struct conn *conn_c)
+{
+	struct pollfd fd = { .fd = conn_b->fd, .events = POLLIN };
+	const struct kdbus_msg *call;
+	struct kdbus_msg *msg;
+	uint64_t off, src_id, cookie;
+	int ret;
+
+	if (poll(&fd, 1, 3000) <= 0)
+		return EXIT_FAILURE;
+
+	if (ioctl(conn_b->fd, KDBUS_CMD_MSG_RECV, &off) < 0)
+		return EXIT_FAILURE;
+
+	call = (const struct kdbus_msg *)((char *)conn_b->buf + off);
+	src_id = call->src_id;
+	cookie = call->cookie;
+	ioctl(conn_b->fd, KDBUS_CMD_MSG_RELEASE, &off);
+
+	msg = make_msg(conn_c, src_id, 100, 0, 0, 8);
+	if (!msg)
+		return EXIT_FAILURE;
+	msg->cookie_reply = cookie;
+	ret = ioctl(conn_c->fd, KDBUS_CMD_MSG_SEND, msg);
+	free(msg);
+	if (ret < 0)
+		return EXIT_FAILURE;
+
+	msg = make_msg(conn_b, src_id, 101, 0, 0, 8);
+	if (!msg)
+		return EXIT_FAILURE;
+	msg->cookie_reply = cookie;
+	ret = ioctl(conn_b->fd, KDBUS_CMD_MSG_SEND, msg);
+	free(msg);
+	if (ret < 0)
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
+
+/* KDBUS_CMD_MSG_CALL returns the reply of the called connection only;
+ * a message of another connection with the same reply cookie is queued
+ * as usual. A call which is not answered in time fails. */
+static int check_call(const char *bus)
+{
+	struct kdbus_cmd_msg_call call;
+	const struct kdbus_msg *reply;
+	struct kdbus_msg *msg;
+	struct test t;
+	uint64_t cookie;
+	pid_t pid;
+	int status;
+	int ret = EXIT_FAILURE;
+
+	printf("-- checking method calls\n");
+
+	if (test_init(&t, bus, 0) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "--- error fork: %m\n");
+		goto exit;
+	}
+
+	if (pid == 0)
+		_exit(call_answer(t.conn_b, t.conn_c));
+
+	msg = make_msg(t.conn_a, t.conn_b->id, 1, 0, 0, 8);
+	if (!msg)
+		goto exit_wait;
+	msg->timeout_ns = 5000000000ULL;
+
+	memset(&call, 0, sizeof(call));
+	call.msg_address = (uint64_t)msg;
+	if (ioctl(t.conn_a->fd, KDBUS_CMD_MSG_CALL, &call) < 0) {
+		fprintf(stderr, "--- error calling: %m\n");
+		free(msg);
+		goto exit_wait;
+	}
+	free(msg);
+
+	reply = (const struct kdbus_msg *)((char *)t.conn_a->buf +
+					   call.reply_offset);
+	if (reply->src_id != t.conn_b->id || reply->cookie != 101 ||
+	    reply->cookie_reply != 1) {
+		fprintf(stderr, "--- wrong reply: src %llu cookie %llu\n",
+			(unsigned long long)reply->src_id,
+			(unsigned long long)reply->cookie);
+		goto exit_wait;
+	}
+	ioctl(t.conn_a->fd, KDBUS_CMD_MSG_RELEASE, &call.reply_offset);
+
+	if (recv_cookie(t.conn_a, &cookie) < 0 || cookie != 100) {
+		fprintf(stderr, "--- message with the reply cookie lost\n");
+		goto exit_wait;
+	}
+
+	/* nobody answers on conn_c */
+	msg = make_msg(t.conn_a, t.conn_c->id, 2, 0, 0, 8);
+	if (!msg)
+		goto exit_wait;
+	msg->timeout_ns = 100000000ULL;
+
+	call.msg_address = (uint64_t)msg;
+	if (ioctl(t.conn_a->fd, KDBUS_CMD_MSG_CALL, &call) == 0 ||
+	    errno != ETIMEDOUT) {
+		fprintf(stderr, "--- unanswered call did not time out\n");
+		free(msg);
+		goto exit_wait;
+	}
+	free(msg);
+
+	/* the REPLY_TIMEOUT notification of the call is not handed out */
+	usleep(200 * 1000);
+	if (recv_cookie(t.conn_a, &cookie) == 0 || errno != EAGAIN) {
+		fprintf(stderr, "--- timeout of the call queued\n");
+		goto exit_wait;
+	}
+
+	ret = EXIT_SUCCESS;
+
+exit_wait:
+	if (waitpid(pid, &status, 0) < 0 ||
+	    !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+		fprintf(stderr, "--- call not answered\n");
+		ret = EXIT_FAILURE;
+	}
+exit:
+	test_exit(&t);
+	return ret;
+}
+
+/* A received call which is not answered times out, or is dead when the
+ * called connection goes away. A caller can only wait for a limited
+ * number of replies, which does not hold back other callers. A reply to
+ * a caller which went away fails. */
+static int check_reply_tracking(const char *bus)
+{
+	struct kdbus_msg *msg;
+	struct test t;
+	uint64_t i, type, cookie, id;
+	int ret = EXIT_FAILURE;
+
+	printf("-- checking reply tracking\n");
+
+	if (test_init(&t, bus, 0) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	if (send_expect_reply(t.conn_a, t.conn_b->id, 1, 100000000ULL) < 0 ||
+	    recv_cookie(t.conn_b, &cookie) < 0) {
+		fprintf(stderr, "--- error sending call: %m\n");
+		goto exit;
+	}
+
+	usleep(200 * 1000);
+	if (recv_notify(t.conn_a, &type, &cookie) < 0 ||
+	    type != KDBUS_MSG_REPLY_TIMEOUT || cookie != 1) {
+		fprintf(stderr, "--- received call did not time out\n");
+		goto exit;
+	}
+
+	/* the receiver takes the calls off its queue, they stay pending */
+	for (i = 0; i < 128; i++) {
+		if (send_expect_reply(t.conn_a, t.conn_b->id, 100 + i, 0) < 0 ||
+		    recv_cookie(t.conn_b, &cookie) < 0) {
+			fprintf(stderr, "--- error sending call %llu: %m\n",
+				(unsigned long long)i);
+			goto exit;
+		}
+	}
+
+	if (send_expect_reply(t.conn_a, t.conn_b->id, 2, 0) == 0 ||
+	    errno != EMLINK) {
+		fprintf(stderr, "--- too many pending calls accepted\n");
+		goto exit;
+	}
+
+	if (send_expect_reply(t.conn_c, t.conn_b->id, 3, 0) < 0 ||
+	    recv_cookie(t.conn_b, &cookie) < 0) {
+		fprintf(stderr, "--- call of another caller failed: %m\n");
+		goto exit;
+	}
+
+	/* all calls to the connection die with it */
+	free_conn(t.conn_b);
+	t.conn_b = NULL;
+
+	if (recv_notify(t.conn_c, &type, &cookie) < 0 ||
+	    type != KDBUS_MSG_REPLY_DEAD || cookie != 3) {
+		fprintf(stderr, "--- call to a closed connection not dead\n");
+		goto exit;
+	}
+
+	if (recv_notify(t.conn_a, &type, &cookie) < 0 ||
+	    type != KDBUS_MSG_REPLY_DEAD) {
+		fprintf(stderr, "--- calls to a closed connection not dead\n");
+		goto exit;
+	}
+
+	/* the dead calls are not pending anymore */
+	if (send_expect_reply(t.conn_a, t.conn_c->id, 4, 0) < 0 ||
+	    recv_cookie(t.conn_c, &cookie) < 0) {
+		fprintf(stderr, "--- dead calls still pending: %m\n");
+		goto exit;
+	}
+
+	id = t.conn_a->id;
+	free_conn(t.conn_a);
+	t.conn_a = NULL;
+
+	msg = make_msg(t.conn_c, id, 5, 0, 0, 8);
+	if (!msg)
+		goto exit;
+	msg->cookie_reply = 4;
+
+	if (ioctl(t.conn_c->fd, KDBUS_CMD_MSG_SEND, msg) == 0 ||
+	    errno != ENXIO) {
+		fprintf(stderr, "--- reply to a closed connection sent\n");
+		free(msg);
+		goto exit;
+	}
+	free(msg);
+
+	ret = EXIT_SUCCESS;
+
+exit:
+	test_exit(&t);
+	return ret;
+}
+
+/* A broadcast on a bus with KDBUS_MAKE_BROADCAST_PARALLEL is delivered
+ * to all receivers, in several shards, before the send returns. */
+static int check_broadcast_parallel(void)
+{
+	struct conn *conns[300] = {};
+	struct conn *conn_src = NULL;
+	uint64_t i, cookie;
+	char *bus;
+	int fdc, ret = EXIT_FAILURE;
+
+	printf("-- checking parallel broadcasts\n");
+
+	fdc = make_bus("testbus-parallel", KDBUS_MAKE_BROADCAST_PARALLEL,
+		       &bus);
+	if (fdc < 0)
+		return EXIT_FAILURE;
+
+	conn_src = connect_to_bus(bus, 0);
+	if (!conn_src)
+		goto exit;
+
+	for (i = 0; i < ELEMENTSOF(conns); i++) {
+		conns[i] = connect_to_bus(bus, 0);
+		if (!conns[i])
+			goto exit;
+
+		add_match_empty(conns[i]->fd);
+	}
+
+	if (send_msg(conn_src, KDBUS_DST_ID_BROADCAST, 1, 0, 0, 4096) < 0) {
+		fprintf(stderr, "--- error sending broadcast: %m\n");
+		goto exit;
+	}
+
+	for (i = 0; i < ELEMENTSOF(conns); i++) {
+		if (recv_cookie(conns[i], &cookie) < 0 || cookie != 1) {
+			fprintf(stderr, "--- receiver %llu did not get the broadcast\n",
+				(unsigned long long)i);
+			goto exit;
+		}
+	}
+
+	ret = EXIT_SUCCESS;
+
+exit:
+	for (i = 0; i < ELEMENTSOF(conns); i++)
+		free_conn(conns[i]);
+	free_conn(conn_src);
+	close(fdc);
+	free(bus);
+	return ret;
+}
+
+/* A message wakes up the poll of its receiver only. */
+static int check_poll_wakeup(const char *bus)
+{
+	struct pollfd fd;
+	struct test t;
+	pid_t pid;
+	int status;
+	int ret = EXIT_FAILURE;
+
+	printf("-- checking poll wakeups\n");
+
+	if (test_init(&t, bus, 0) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "--- error fork: %m\n");
+		goto exit;
+	}
+
+	if (pid == 0) {
+		usleep(50 * 1000);
+		_exit(send_msg(t.conn_a, t.conn_b->id, 1, 0, 0, 8) < 0 ?
+		      EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	fd.fd = t.conn_c->fd;
+	fd.events = POLLIN;
+	fd.revents = 0;
+	if (poll(&fd, 1, 200) != 0) {
+		fprintf(stderr, "--- poll of another connection returned\n");
+		goto exit_wait;
+	}
+
+	fd.fd = t.conn_b->fd;
+	fd.revents = 0;
+	if (poll(&fd, 1, 3000) != 1 || !(fd.revents & POLLIN)) {
+		fprintf(stderr, "--- receiver not readable\n");
+		goto exit_wait;
+	}
+
+	ret = EXIT_SUCCESS;
+
+exit_wait:
+	if (waitpid(pid, &status, 0) < 0 ||
+	    !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+		fprintf(stderr, "--- error sending message\n");
+		ret = EXIT_FAILURE;
+	}
+exit:
+	test_exit(&t);
+	return ret;
+}
+
+/* A sender which ran out of space at a receiver is not writable until
+ * the receiver frees space. */
+static int check_pollout(const char *bus)
+{
+	struct pollfd fd;
+	struct test t;
+	uint64_t cookie;
+	int ret = EXIT_FAILURE;
+
+	printf("-- checking POLLOUT\n");
+
+	if (test_init(&t, bus, 0) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	fd.fd = t.conn_a->fd;
+	fd.events = POLLOUT;
+
+	fd.revents = 0;
+	if (poll(&fd, 1, 0) != 1 || !(fd.revents & POLLOUT)) {
+		fprintf(stderr, "--- new connection not writable\n");
+		goto exit;
+	}
+
+	if (fill_conn(t.conn_a, t.conn_b) <= 0)
+		goto exit;
+
+	fd.revents = 0;
+	if (poll(&fd, 1, 0) != 0) {
+		fprintf(stderr, "--- writable while the receiver is full\n");
+		goto exit;
+	}
+
+	if (recv_cookie(t.conn_b, &cookie) < 0) {
+		fprintf(stderr, "--- error receiving message: %m\n");
+		goto exit;
+	}
+
+	fd.revents = 0;
+	if (poll(&fd, 1, 0) != 1 || !(fd.revents & POLLOUT)) {
+		fprintf(stderr, "--- not writable after the receiver freed space\n");
+		goto exit;
+	}
+
+	ret = EXIT_SUCCESS;
+
+exit:
+	test_exit(&t);
+	return ret;
+}
+
+/* With KDBUS_MSG_SEND_TIMEOUT, a send to a full receiver blocks until
+ * the receiver frees space, or the timeout expires. A sender which ran
+ * out of space at another receiver before is woken up by the receiver
+ * it waits for. */
+static int check_send_timeout(const char *bus)
+{
+	struct test t;
+	uint64_t cookie, start;
+	pid_t pid;
+	int status;
+	int ret = EXIT_FAILURE;
+
+	printf("-- checking send timeouts\n");
+
+	if (test_init(&t, bus, 0) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	if (send_msg(t.conn_a, KDBUS_DST_ID_BROADCAST, 1,
+		     KDBUS_MSG_SEND_TIMEOUT, 1000000, 8) == 0 ||
+	    errno != ENOTUNIQ) {
+		fprintf(stderr, "--- send timeout accepted for a broadcast\n");
+		goto exit;
+	}
+
+	if (fill_conn(t.conn_a, t.conn_b) <= 0 ||
+	    fill_conn(t.conn_a, t.conn_c) <= 0)
+		goto exit;
+
+	/* the receiver stays full */
+	start = now_ns();
+	if (send_msg(t.conn_a, t.conn_b->id, 1, KDBUS_MSG_SEND_TIMEOUT,
+		     100000000ULL, 8) == 0 ||
+	    (errno != ENOBUFS && errno != EXFULL)) {
+		fprintf(stderr, "--- send to a full receiver: %m\n");
+		goto exit;
+	}
+
+	if (now_ns() - start < 90000000ULL) {
+		fprintf(stderr, "--- send did not wait for the timeout\n");
+		goto exit;
+	}
+
+	/* the receiver frees space while the sender waits */
+	pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "--- error fork: %m\n");
+		goto exit;
+	}
+
+	if (pid == 0) {
+		usleep(100000);
+		_exit(recv_cookie(t.conn_b, &cookie) < 0 ?
+		      EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	start = now_ns();
+	if (send_msg(t.conn_a, t.conn_b->id, 2, KDBUS_MSG_SEND_TIMEOUT,
+		     5000000000ULL, 8) < 0)
+		fprintf(stderr, "--- blocking send failed: %m\n");
+	else if (now_ns() - start >= 5000000000ULL)
+		fprintf(stderr, "--- blocking send was not woken up\n");
+	else
+		ret = EXIT_SUCCESS;
+
+	if (waitpid(pid, &status, 0) < 0 ||
+	    !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+		fprintf(stderr, "--- receiver did not free space\n");
+		ret = EXIT_FAILURE;
+	}
+
+exit:
+	test_exit(&t);
+	return ret;
+}
+
+/* send a message to conn_b, and check the name of the sending thread
+ * which is attached to it */
+static int recv_comm(const struct test *t, uint64_t cookie, const char *comm)
+{
+	const struct kdbus_msg *msg;
+	const struct kdbus_item *item;
+	const char *str = NULL;
+	uint64_t off;
+
+	if (send_msg(t->conn_a, t->conn_b->id, cookie, 0, 0, 8) < 0 ||
+	    ioctl(t->conn_b->fd, KDBUS_CMD_MSG_RECV, &off) < 0) {
+		fprintf(stderr, "--- error sending message: %m\n");
+		return EXIT_FAILURE;
+	}
+
+	msg = (const struct kdbus_msg *)((char *)t->conn_b->buf + off);
+	KDBUS_PART_FOREACH(item, msg, items)
+		if (item->type == KDBUS_MSG_SRC_TID_COMM)
+			str = item->str;
+
+	if (!str || strcmp(str, comm) != 0) {
+		fprintf(stderr, "--- sender comm '%s', expected '%s'\n",
+			str ? str : "", comm);
+		str = NULL;
+	}
+
+	ioctl(t->conn_b->fd, KDBUS_CMD_MSG_RELEASE, &off);
+	return str ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* The metadata of a sender is attached as it is at the time of the
+ * send, also right after it changed. */
+static int check_meta_comm(const char *bus)
+{
+	char comm[16] = {};
+	struct test t;
+	int ret = EXIT_FAILURE;
+
+	printf("-- checking sender metadata\n");
+
+	if (prctl(PR_GET_NAME, comm) < 0)
+		return EXIT_FAILURE;
+
+	if (test_init(&t, bus, 0) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	if (recv_comm(&t, 1, comm) != EXIT_SUCCESS)
+		goto exit;
+
+	prctl(PR_SET_NAME, "kdbus-renamed");
+	ret = recv_comm(&t, 2, "kdbus-renamed");
+	prctl(PR_SET_NAME, comm);
+
+exit:
+	test_exit(&t);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	int fdc, ret, cookie;
+	char *bus;
+	struct conn *conn_a, *conn_b;
+	struct pollfd fds[2];
+	int count;
+
+	fdc = make_bus("testbus", 0, &bus);
+	if (fdc < 0)
+		return EXIT_FAILURE;
+
+	if (check_pool_grow(bus) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	if (check_pool_hugepage(bus) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	if (check_pool_locked(bus) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	if (check_pool_ring(bus) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	if (check_submit_ring(bus) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	if (check_batch(bus) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	if (check_priority(bus) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	if (check_deadlines(bus) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	if (check_concurrent_send(bus) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	if (check_call(bus) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	if (check_reply_tracking(bus) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	if (check_broadcast_parallel() != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	if (check_poll_wakeup(bus) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	if (check_pollout(bus) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	if (check_send_timeout(bus) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	if (check_meta_comm(bus) != EXIT_SUCCESS)
 		return EXIT_FAILURE;
 
-	conn_a = connect_to_bus(bus);
-	conn_b = connect_to_bus(bus);
+	conn_a = connect_to_bus(bus, 0);
+	conn_b = connect_to_bus(bus, 0);
 	if (!conn_a || !conn_b)
 		return EXIT_FAILURE;
 